@@ -0,0 +1,302 @@
+/*
+ * host_mq2.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#include "host_mq2.hpp"
+#include "luna.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string_view>
+
+class MQ2Type {
+public:
+  const char* name;
+};
+
+MQ2* mq2;
+
+namespace {
+MQ2Type int_type{"int"};
+MQ2Type int64_type{"int64"};
+MQ2Type float_type{"float"};
+MQ2Type double_type{"double"};
+MQ2Type string_type{"string"};
+MQ2Type bool_type{"bool"};
+
+host::Simulation* simulation_of(lua_State* ls) {
+  return static_cast<host::Simulation*>(lua_touserdata(ls, lua_upvalueindex(1)));
+}
+} // namespace
+
+namespace host {
+Simulation* sim = nullptr;
+
+Simulation::Simulation() : start_{std::chrono::steady_clock::now()}, now_{start_} {
+  ls_ = luaL_newstate();
+  luaL_openlibs(ls_);
+  const luaL_Reg host_lib[] = {
+      {"chat", host_chat},     {"command", host_command}, {"zone", host_zone}, {"game_state", host_game_state},
+      {"time", host_time},     {"stop", host_stop},       {nullptr, nullptr},
+  };
+  lua_newtable(ls_);
+  lua_pushlightuserdata(ls_, this);
+  luaL_setfuncs(ls_, host_lib, 1);
+  lua_setglobal(ls_, "host");
+}
+
+Simulation::~Simulation() { lua_close(ls_); }
+
+bool Simulation::load_script(const char* path) {
+  if (luaL_dofile(ls_, path) != LUA_OK) {
+    report_error("loading the script");
+    return false;
+  }
+  return true;
+}
+
+bool Simulation::frame(std::uint64_t n) {
+  if (!stopped_ && lua_getglobal(ls_, "frame") == LUA_TFUNCTION) {
+    lua_pushinteger(ls_, lua_Integer(n));
+    if (lua_pcall(ls_, 1, 0, 0) != LUA_OK) {
+      report_error("frame");
+    }
+  } else {
+    lua_pop(ls_, 1);
+  }
+  return !stopped_;
+}
+
+void Simulation::queue_answer(std::string_view expr, const TraceAnswer& answer) {
+  auto it = recorded_.find(expr);
+  if (it == recorded_.end()) {
+    it = recorded_.emplace(std::string{expr}, Recorded{}).first;
+  }
+  Recorded& recorded = it->second;
+  // whatever is left from an earlier hook is stale now.
+  if (recorded.hook != hook_) {
+    recorded.answers.clear();
+    recorded.hook = hook_;
+  }
+  recorded.answers.push_back(answer);
+}
+
+bool Simulation::recorded_answer(std::deque<TraceAnswer>& answers, MQ2TypeVar& result) {
+  const TraceAnswer& answer = answers.front();
+  result.Int64 = 0;
+  switch (answer.kind) {
+  case TraceAnswer::Kind::None:
+    result.Type = nullptr;
+    break;
+  case TraceAnswer::Kind::Int:
+    result.Type = &int_type;
+    result.Int = int(answer.integer);
+    break;
+  case TraceAnswer::Kind::Int64:
+    result.Type = &int64_type;
+    result.Int64 = answer.integer;
+    break;
+  case TraceAnswer::Kind::Float:
+    result.Type = &float_type;
+    result.Float = float(answer.number);
+    break;
+  case TraceAnswer::Kind::Double:
+    result.Type = &double_type;
+    result.Double = answer.number;
+    break;
+  case TraceAnswer::Kind::String:
+    answer_ = answer.string;
+    result.Type = &string_type;
+    result.Ptr = answer_.data();
+    break;
+  case TraceAnswer::Kind::Other:
+    result.Type = &bool_type;
+    result.DWord = DWORD(answer.integer);
+    break;
+  }
+  bool answered = answer.kind != TraceAnswer::Kind::None;
+  if (answers.size() > 1) {
+    answers.pop_front();
+  }
+  return answered;
+}
+
+bool Simulation::parse_data(const char* expr, MQ2TypeVar& result) {
+  ++counters.data_queries;
+  if (auto it = recorded_.find(std::string_view{expr}); it != recorded_.end()) {
+    bool answered = recorded_answer(it->second.answers, result);
+    counters.data_misses += !answered;
+    return answered;
+  }
+  int type = lua_getglobal(ls_, "data");
+  if (type == LUA_TFUNCTION) {
+    lua_pushstring(ls_, expr);
+    if (lua_pcall(ls_, 1, 1, 0) != LUA_OK) {
+      report_error(expr);
+      lua_pushnil(ls_);
+    }
+  } else if (type == LUA_TTABLE) {
+    lua_getfield(ls_, -1, expr);
+    lua_remove(ls_, -2);
+  }
+  bool answered = true;
+  result.Int64 = 0;
+  switch (lua_type(ls_, -1)) {
+  case LUA_TNUMBER:
+    if (!lua_isinteger(ls_, -1)) {
+      result.Type = &double_type;
+      result.Double = lua_tonumber(ls_, -1);
+    } else if (auto n = lua_tointeger(ls_, -1);
+               n >= std::numeric_limits<int>::min() && n <= std::numeric_limits<int>::max()) {
+      result.Type = &int_type;
+      result.Int = int(n);
+    } else {
+      result.Type = &int64_type;
+      result.Int64 = n;
+    }
+    break;
+  case LUA_TBOOLEAN:
+    result.Type = &bool_type;
+    result.DWord = lua_toboolean(ls_, -1);
+    break;
+  case LUA_TSTRING:
+    answer_.assign(lua_tostring(ls_, -1));
+    result.Type = &string_type;
+    result.Ptr = answer_.data();
+    break;
+  default:
+    answered = false;
+    ++counters.data_misses;
+  }
+  lua_pop(ls_, 1);
+  return answered;
+}
+
+void Simulation::write_chat(const char* line) {
+  ++counters.chat_lines;
+  if (!quiet) {
+    // without the \ag style color codes.
+    stripped_.clear();
+    for (const char* p = line; *p != '\0'; ++p) {
+      if (*p != '\a') {
+        stripped_ += *p;
+      } else if (p[1] != '\0') {
+        p += p[1] == '-' && p[2] != '\0' ? 2 : 1;
+      }
+    }
+    std::printf("%s\n", stripped_.c_str());
+  }
+  notify("on_chat", line);
+}
+
+void Simulation::do_command(const char* cmd) {
+  ++counters.commands;
+  if (!quiet) {
+    std::printf("> %s\n", cmd);
+  }
+  notify("on_command", cmd);
+  type_command(cmd);
+}
+
+void Simulation::type_command(const char* cmd) {
+  std::string_view sv{cmd};
+  if (sv.starts_with("/luna ")) {
+    luna->Cmd(cmd + 6);
+  } else if (sv.starts_with("/ldo ")) {
+    luna->BoundCommand(cmd + 5);
+  }
+}
+
+void Simulation::notify(const char* fn, const char* arg) {
+  if (lua_getglobal(ls_, fn) != LUA_TFUNCTION) {
+    lua_pop(ls_, 1);
+    return;
+  }
+  lua_pushstring(ls_, arg);
+  if (lua_pcall(ls_, 1, 0, 0) != LUA_OK) {
+    report_error(fn);
+  }
+}
+
+void Simulation::report_error(const char* what) {
+  std::fprintf(stderr, "luna_host: script error in %s: %s\n", what, lua_tostring(ls_, -1));
+  lua_pop(ls_, 1);
+}
+
+int Simulation::host_chat(lua_State* ls) {
+  const char* line = luaL_checkstring(ls, 1);
+  luna->OnIncomingChat(line, std::uint32_t(luaL_optinteger(ls, 2, USERCOLOR_DEFAULT)));
+  return 0;
+}
+
+int Simulation::host_command(lua_State* ls) {
+  simulation_of(ls)->type_command(luaL_checkstring(ls, 1));
+  return 0;
+}
+
+int Simulation::host_zone(lua_State*) {
+  luna->OnBeginZone();
+  luna->OnEndZone();
+  luna->OnZoned();
+  return 0;
+}
+
+int Simulation::host_game_state(lua_State* ls) {
+  auto state = DWORD(luaL_checkinteger(ls, 1));
+  simulation_of(ls)->game_state = state;
+  luna->SetGameState(GameState{state});
+  return 0;
+}
+
+int Simulation::host_time(lua_State* ls) {
+  auto elapsed = simulation_of(ls)->elapsed();
+  lua_pushinteger(ls, std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count());
+  return 1;
+}
+
+int Simulation::host_stop(lua_State* ls) {
+  simulation_of(ls)->stopped_ = true;
+  return 0;
+}
+} // namespace host
+
+MQ2::MQ2() {
+  pIntType = &int_type;
+  pInt64Type = &int64_type;
+  pDoubleType = &double_type;
+  pStringType = &string_type;
+  pBoolType = &bool_type;
+  pFloatType = &float_type;
+  pArrayType = pByteType = pMacroType = pMathType = pPluginType = pTimeType = pTypeType = nullptr;
+  pEverQuestType = pSpawnType = pSpellType = nullptr;
+  ppLocalPlayer = nullptr;
+  // Luna looks for luna/ next to MQ2Main.dll.
+  static std::string dll_path;
+  dll_path = host::sim->mq2_dir + "/MQ2Main.dll";
+  mq2_dir = dll_path.c_str();
+}
+
+BOOL MQ2::ParseMQ2DataPortion(const char* data_var, MQ2TypeVar& result) {
+  return host::sim->parse_data(data_var, result);
+}
+
+BOOL MQ2::ParseMQ2DataPortionInPlace(PCHAR buf, MQ2TypeVar& result) { return host::sim->parse_data(buf, result); }
+
+VOID MQ2::WriteChatColor(const char* Line, DWORD, DWORD) { host::sim->write_chat(Line); }
+
+VOID MQ2::WriteChatColorInPlace(PCHAR Line, DWORD, DWORD) { host::sim->write_chat(Line); }
+
+void MQ2::DoCommand(PSPAWNINFO, const char* szLine) { host::sim->do_command(szLine); }
+
+void MQ2::DoCommand(const char* szLine) { host::sim->do_command(szLine); }
+
+DWORD MQ2::GetGameState(VOID) { return host::sim->game_state; }
+
+VOID MQ2::AddCommand(const char*, fEQCommand, BOOL, BOOL, BOOL) {}
+
+VOID MQ2::RemoveCommand(const char*) {}
@@ -0,0 +1,104 @@
+/*
+ * host_mq2.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef HOST_MQ2_HPP38614
+#define HOST_MQ2_HPP38614
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <string_view>
+
+#include "lua.hpp"
+#include "luna_defs.hpp"
+#include "mq2_api.hpp"
+#include "trace.hpp"
+
+namespace host {
+struct Counters {
+  std::uint64_t chat_lines = 0;
+  std::uint64_t commands = 0;
+  std::uint64_t data_queries = 0;
+  // queries without an answer, MQ2 returning NULL.
+  std::uint64_t data_misses = 0;
+};
+
+// The game side of luna_host: what the MQ2 stand-in answers, where its output goes, and the simulated
+// clock. All of it is driven by a lua script run in a state of its own, which may set
+//   data             a table of expression = answer, or a function(expr) returning the answer
+//   frame(n)         called before every pulse
+//   on_chat(line)    called for every line Luna writes to chat
+//   on_command(cmd)  called for every command Luna issues
+// and call host.chat(line [, color]), host.command(cmd), host.zone(), host.game_state(n), host.time() (ms
+// since the start) and host.stop().
+class Simulation {
+public:
+  Simulation();
+  ~Simulation();
+  Simulation(const Simulation& other) = delete;
+  Simulation& operator=(const Simulation& other) = delete;
+
+  bool load_script(const char* path);
+  // false once the script called host.stop().
+  bool frame(std::uint64_t n);
+  inline void advance(std::chrono::steady_clock::duration d) { now_ += d; }
+  inline std::chrono::steady_clock::time_point now() const { return now_; }
+  inline std::chrono::steady_clock::duration elapsed() const { return now_ - start_; }
+  // moves the clock to a point in a trace, it never goes back.
+  inline void set_elapsed(std::chrono::steady_clock::duration d) { now_ = std::max(now_, start_ + d); }
+  // answers from a trace come before the script's. The ones queued for a hook are given once each in order,
+  // the last one stays until the next hook queues new ones for the expression.
+  inline void begin_hook() { ++hook_; }
+  void queue_answer(std::string_view expr, const TraceAnswer& answer);
+
+  // the MQ2 side.
+  bool parse_data(const char* expr, MQ2TypeVar& result);
+  void write_chat(const char* line);
+  void do_command(const char* cmd);
+  // a command typed in game: /luna and /ldo go to Luna, anything else has nowhere to go.
+  void type_command(const char* cmd);
+
+  // the directory luna/ is in.
+  std::string mq2_dir = ".";
+  DWORD game_state = DWORD(GameState::GAMESTATE_INGAME);
+  bool quiet = false;
+  Counters counters;
+
+private:
+  // answers is never empty.
+  bool recorded_answer(std::deque<TraceAnswer>& answers, MQ2TypeVar& result);
+  static int host_chat(lua_State* ls);
+  static int host_command(lua_State* ls);
+  static int host_zone(lua_State* ls);
+  static int host_game_state(lua_State* ls);
+  static int host_time(lua_State* ls);
+  static int host_stop(lua_State* ls);
+  // calls the global fn with arg if the script defined it.
+  void notify(const char* fn, const char* arg);
+  void report_error(const char* what);
+
+  lua_State* ls_ = nullptr;
+  std::chrono::steady_clock::time_point start_;
+  std::chrono::steady_clock::time_point now_;
+  // string answers point in here, MQ2 hands out its own buffer the same way.
+  std::string answer_;
+  struct Recorded {
+    std::deque<TraceAnswer> answers;
+    std::uint64_t hook = 0;
+  };
+  std::map<std::string, Recorded, std::less<>> recorded_;
+  std::uint64_t hook_ = 0;
+  std::string stripped_;
+  bool stopped_ = false;
+};
+
+extern Simulation* sim;
+} // namespace host
+
+#endif /* !HOST_MQ2_HPP38614 */
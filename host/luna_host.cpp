@@ -0,0 +1,169 @@
+/*
+ * luna_host.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+// Runs Luna and its modules without the game, against the MQ2 stand-in in host_mq2.cpp. Pulses are
+// driven back to back on a simulated clock, so a module that sleeps costs nothing and what's left is the
+// time Luna and the modules spend working. With --replay it plays back a session recorded in game with
+// /luna record instead.
+
+#include "host_mq2.hpp"
+#include "luna.hpp"
+#include "replay.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+struct Options {
+  std::string mq2_dir = ".";
+  const char* script = nullptr;
+  // 0 runs until the script calls host.stop().
+  std::uint64_t frames = 1000;
+  std::uint64_t frame_ms = 16;
+  bool quiet = false;
+  const char* replay = nullptr;
+  bool realtime = false;
+  std::vector<std::string> modules;
+};
+
+void usage() {
+  std::fprintf(stderr, "usage: luna_host [options] [module ...]\n"
+                       "  --mq2-dir DIR    directory with luna/ in it (default .)\n"
+                       "  --script FILE    script answering luna.data and driving the game, see host_mq2.hpp\n"
+                       "  --frames N       pulses to run, 0 runs until the script stops (default 1000)\n"
+                       "  --frame-ms MS    simulated time per pulse (default 16)\n"
+                       "  --quiet          don't print chat output and commands\n"
+                       "  --replay FILE    play back a trace from /luna record instead of running frames\n"
+                       "  --realtime       replay with the trace's own timing rather than back to back\n");
+}
+
+bool parse_number(const char* arg, std::uint64_t& out) {
+  auto end = arg + std::strlen(arg);
+  auto res = std::from_chars(arg, end, out);
+  return res.ec == std::errc{} && res.ptr == end;
+}
+
+bool parse_options(int argc, char** argv, Options& opts) {
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--mq2-dir" && has_value) {
+      opts.mq2_dir = argv[++i];
+    } else if (arg == "--script" && has_value) {
+      opts.script = argv[++i];
+    } else if (arg == "--frames" && has_value) {
+      if (!parse_number(argv[++i], opts.frames)) {
+        return false;
+      }
+    } else if (arg == "--frame-ms" && has_value) {
+      if (!parse_number(argv[++i], opts.frame_ms)) {
+        return false;
+      }
+    } else if (arg == "--quiet") {
+      opts.quiet = true;
+    } else if (arg == "--replay" && has_value) {
+      opts.replay = argv[++i];
+    } else if (arg == "--realtime") {
+      opts.realtime = true;
+    } else if (arg.starts_with("--")) {
+      return false;
+    } else {
+      opts.modules.emplace_back(arg);
+    }
+  }
+  return true;
+}
+
+double to_us(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration<double, std::micro>(d).count();
+}
+
+void print_summary(const host::Simulation& simulation, std::vector<std::chrono::steady_clock::duration>& pulses,
+                   std::chrono::steady_clock::duration wall) {
+  auto frames = pulses.size();
+  using seconds = std::chrono::duration<double>;
+  std::fprintf(stderr, "luna_host: %zu frames, %.1fs simulated in %.3fs\n", frames,
+               seconds(simulation.elapsed()).count(), seconds(wall).count());
+  if (frames > 0) {
+    std::chrono::steady_clock::duration total{};
+    for (auto d : pulses) {
+      total += d;
+    }
+    std::sort(pulses.begin(), pulses.end());
+    std::fprintf(stderr, "  pulse: mean %.1fus, p50 %.1fus, p99 %.1fus, max %.1fus\n", to_us(total) / double(frames),
+                 to_us(pulses[frames / 2]), to_us(pulses[frames * 99 / 100]), to_us(pulses.back()));
+  }
+  const host::Counters& c = simulation.counters;
+  std::fprintf(stderr, "  output: %llu chat lines, %llu commands\n", (unsigned long long)c.chat_lines,
+               (unsigned long long)c.commands);
+  std::fprintf(stderr, "  data: %llu queries, %llu unanswered\n", (unsigned long long)c.data_queries,
+               (unsigned long long)c.data_misses);
+}
+} // namespace
+
+int main(int argc, char** argv) {
+  Options opts;
+  if (!parse_options(argc, argv, opts)) {
+    usage();
+    return 2;
+  }
+  host::Simulation simulation;
+  host::sim = &simulation;
+  simulation.mq2_dir = opts.mq2_dir;
+  simulation.quiet = opts.quiet;
+  zx::clock_override = [] { return host::sim->now(); };
+
+  mq2 = new MQ2();
+  luna = new Luna();
+  int status = 0;
+  if (opts.script != nullptr && !simulation.load_script(opts.script)) {
+    status = 1;
+  } else if (!opts.modules.empty()) {
+    std::string cmd = "run";
+    for (const std::string& name : opts.modules) {
+      cmd += " " + name;
+    }
+    luna->Cmd(cmd.c_str());
+  }
+
+  if (status == 0 && opts.replay != nullptr) {
+    status = host::replay_trace(opts.replay, simulation, opts.realtime) ? 0 : 1;
+  }
+
+  std::vector<std::chrono::steady_clock::duration> pulses;
+  if (opts.replay == nullptr) {
+    pulses.reserve(std::min<std::uint64_t>(opts.frames, 1 << 20));
+  }
+  auto wall_start = std::chrono::steady_clock::now();
+  for (std::uint64_t n = 0; status == 0 && opts.replay == nullptr && (opts.frames == 0 || n < opts.frames); ++n) {
+    simulation.advance(std::chrono::milliseconds(opts.frame_ms));
+    if (!simulation.frame(n)) {
+      break;
+    }
+    auto start = std::chrono::steady_clock::now();
+    luna->OnPulse();
+    luna->OnDrawHUD();
+    pulses.push_back(std::chrono::steady_clock::now() - start);
+  }
+  auto wall = std::chrono::steady_clock::now() - wall_start;
+
+  delete luna;
+  luna = nullptr;
+  if (status == 0 && opts.replay == nullptr) {
+    print_summary(simulation, pulses, wall);
+  }
+  delete mq2;
+  mq2 = nullptr;
+  zx::clock_override = nullptr;
+  host::sim = nullptr;
+  return status;
+}
@@ -0,0 +1,75 @@
+/*
+ * matcher_check.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+// Checks EventMatcher against std::regex_match for patterns that have tripped up the automaton or the
+// literal prefilter before, after compacting away a removed context's patterns. Exits non-zero if any
+// disagree.
+
+#include <algorithm>
+#include <cstdio>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "event_matcher.hpp"
+
+namespace {
+struct Case {
+  const char* pattern;
+  std::string line;
+};
+
+const Case cases[] = {
+  // quantifier bounds and escape payloads aren't literal text the line has to contain.
+  {R"(\d{1,40})", "12345"},
+  {"x{33}", std::string(33, 'x')},
+  {R"(\bfoo{2,3}\b)", "fooo"},
+  {R"(\x41\b)", "A"},
+  {R"(A\b)", "A"},
+  {R"(\cJ\b)", "\n"},
+  {R"((a)\1\b)", "aa"},
+  {R"(You have slain (.+)!)", "You have slain a rat!"},
+  {R"(\bYou have slain (.+)!)", "You have slain a rat!"},
+  {R"((\w+) tells you, '(.*)'\b)", "Soandso tells you, 'hi'"},
+  {R"(\w+ hits you for \d+ points? of damage\.)", "a rat hits you for 3 points of damage."},
+};
+} // namespace
+
+int main() {
+  EventMatcher matcher;
+  // a stopped module's patterns in between the live ones, compact has to renumber around them.
+  int stopped_module = 0;
+  auto stopped = reinterpret_cast<LunaContext*>(&stopped_module);
+  for (const auto& c : cases) {
+    matcher.add(stopped, 0, c.pattern);
+    matcher.add(nullptr, 0, c.pattern);
+  }
+  matcher.remove_context(stopped);
+  matcher.compact();
+  int failures = 0;
+  std::vector<int> hits;
+  for (const auto& c : cases) {
+    hits.clear();
+    matcher.match(c.line, hits);
+    for (auto id = 0u; id < matcher.pattern_count(); ++id) {
+      const auto& p = matcher.pattern(id);
+      bool want = std::regex_match(c.line, p.re);
+      bool got = std::find(hits.begin(), hits.end(), static_cast<int>(id)) != hits.end();
+      if (want != got) {
+        std::fprintf(stderr, "'%s' on \"%s\": expected %s (literal \"%s\")\n", p.source.c_str(), c.line.c_str(),
+                     want ? "a match" : "no match", p.literal.c_str());
+        ++failures;
+      }
+    }
+  }
+  if (matcher.pattern_count() != std::size(cases)) {
+    std::fprintf(stderr, "%zu patterns left after compact, expected %zu\n", matcher.pattern_count(), std::size(cases));
+    ++failures;
+  }
+  std::printf("%zu patterns, %zu lines, %d failures\n", matcher.pattern_count(), std::size(cases), failures);
+  return failures == 0 ? 0 : 1;
+}
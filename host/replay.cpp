@@ -0,0 +1,125 @@
+/*
+ * replay.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#include "replay.hpp"
+#include "luna.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace {
+using Durations = std::vector<std::chrono::steady_clock::duration>;
+
+void dispatch(const TraceRecord& record, host::Simulation& simulation) {
+  switch (record.kind) {
+  case TraceKind::Pulse:
+    luna->OnPulse();
+    break;
+  case TraceKind::DrawHUD:
+    luna->OnDrawHUD();
+    break;
+  case TraceKind::Zoned:
+    luna->OnZoned();
+    break;
+  case TraceKind::BeginZone:
+    luna->OnBeginZone();
+    break;
+  case TraceKind::EndZone:
+    luna->OnEndZone();
+    break;
+  case TraceKind::CleanUI:
+    luna->OnCleanUI();
+    break;
+  case TraceKind::ReloadUI:
+    luna->OnReloadUI();
+    break;
+  case TraceKind::GameState:
+    simulation.game_state = record.value;
+    luna->SetGameState(GameState{record.value});
+    break;
+  case TraceKind::Chat:
+    luna->OnIncomingChat(record.text.c_str(), record.value);
+    break;
+  case TraceKind::LunaCommand:
+    luna->Cmd(record.text.c_str());
+    break;
+  case TraceKind::BindCommand:
+    luna->BoundCommand(record.text.c_str());
+    break;
+  default:
+    break;
+  }
+}
+
+double to_us(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration<double, std::micro>(d).count();
+}
+} // namespace
+
+namespace host {
+bool replay_trace(const char* path, Simulation& simulation, bool realtime) {
+  TraceReader reader;
+  if (!reader.open(path)) {
+    std::fprintf(stderr, "luna_host: %s isn't a luna trace.\n", path);
+    return false;
+  }
+  std::array<Durations, std::size_t(TraceKind::Count)> timings;
+  TraceRecord record;
+  TraceRecord next;
+  bool have_next = reader.next(next);
+  auto wall_start = std::chrono::steady_clock::now();
+  while (have_next) {
+    std::swap(record, next);
+    // the answers luna got during a hook are recorded right after it.
+    simulation.begin_hook();
+    if (record.kind == TraceKind::Data) {
+      simulation.queue_answer(record.text, record.answer);
+    }
+    while ((have_next = reader.next(next)) && next.kind == TraceKind::Data) {
+      simulation.queue_answer(next.text, next.answer);
+    }
+    // replaying /luna record would start writing a trace of the replay.
+    if (record.kind == TraceKind::Data ||
+        (record.kind == TraceKind::LunaCommand && std::string_view{record.text}.starts_with("record"))) {
+      continue;
+    }
+    simulation.set_elapsed(record.time);
+    if (realtime) {
+      std::this_thread::sleep_until(wall_start + record.time);
+    }
+    auto start = std::chrono::steady_clock::now();
+    dispatch(record, simulation);
+    timings[std::size_t(record.kind)].push_back(std::chrono::steady_clock::now() - start);
+  }
+  auto wall = std::chrono::steady_clock::now() - wall_start;
+
+  using seconds = std::chrono::duration<double>;
+  std::fprintf(stderr, "luna_host: replayed %.1fs of %s in %.3fs\n", seconds(simulation.elapsed()).count(), path,
+               seconds(wall).count());
+  std::fprintf(stderr, "  %-14s %10s %12s %10s %10s %10s\n", "hook", "calls", "total ms", "mean us", "p99 us",
+               "max us");
+  for (std::size_t kind = 0; kind < timings.size(); ++kind) {
+    Durations& calls = timings[kind];
+    if (calls.empty()) {
+      continue;
+    }
+    std::chrono::steady_clock::duration total{};
+    for (auto d : calls) {
+      total += d;
+    }
+    std::sort(calls.begin(), calls.end());
+    std::fprintf(stderr, "  %-14s %10zu %12.3f %10.1f %10.1f %10.1f\n", trace_kind_name(TraceKind(kind)), calls.size(),
+                 to_us(total) / 1000, to_us(total) / double(calls.size()), to_us(calls[calls.size() * 99 / 100]),
+                 to_us(calls.back()));
+  }
+  return true;
+}
+} // namespace host
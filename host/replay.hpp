@@ -0,0 +1,19 @@
+/*
+ * replay.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef REPLAY_HPP27730
+#define REPLAY_HPP27730
+
+#include "host_mq2.hpp"
+
+namespace host {
+// Plays a /luna record trace back into luna. The simulated clock follows the trace and data queries get
+// the recorded answers. With realtime the gaps between hooks are waited out, otherwise it runs as fast
+// as it can. Prints how long luna spent in each kind of hook, false if the trace can't be read.
+bool replay_trace(const char* path, Simulation& simulation, bool realtime);
+} // namespace host
+
+#endif /* !REPLAY_HPP27730 */
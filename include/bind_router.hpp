@@ -0,0 +1,75 @@
+/*
+ * bind_router.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef BIND_ROUTER_HPP55208
+#define BIND_ROUTER_HPP55208
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct LunaContext;
+
+// Maps /ldo command names to the module and registry key of their handler. Open addressing with linear
+// probing over a single flat table, kept at most half full.
+class BindRouter {
+public:
+  struct Route {
+    LunaContext* ctx;
+    int fn_key;
+  };
+
+  // false if the command is already bound.
+  bool add(std::string_view command, LunaContext* ctx, int fn_key);
+  const Route* find(std::string_view command) const;
+  void remove_context(const LunaContext* ctx);
+  void clear();
+  inline std::size_t size() const { return size_; }
+
+private:
+  enum class State : std::uint8_t { Empty, Full, Removed };
+  struct Slot {
+    std::string command;
+    std::uint64_t hash = 0;
+    Route route = {nullptr, 0};
+    State state = State::Empty;
+  };
+
+  // index of the full slot holding command, or of the empty slot that ends its probe sequence.
+  std::size_t probe(std::string_view command, std::uint64_t hash) const;
+  void rehash(std::size_t capacity);
+
+  std::vector<Slot> slots_;
+  std::size_t size_ = 0;
+  // full plus removed, removed slots still lengthen probe sequences until the next rehash.
+  std::size_t used_ = 0;
+};
+
+// Commands queued for the next pulse, stored back to back in one buffer that keeps its capacity
+// from pulse to pulse.
+class CommandArena {
+public:
+  void push(std::string_view command);
+  // only valid until the next push.
+  inline std::string_view operator[](std::size_t i) const {
+    return {text_.data() + spans_[i].offset, spans_[i].length};
+  }
+  inline std::size_t size() const { return spans_.size(); }
+  void clear();
+
+private:
+  struct Span {
+    std::uint32_t offset;
+    std::uint32_t length;
+  };
+
+  std::string text_;
+  std::vector<Span> spans_;
+};
+
+#endif /* !BIND_ROUTER_HPP55208 */
@@ -0,0 +1,72 @@
+/*
+ * bytecode_cache.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef BYTECODE_CACHE_HPP17346
+#define BYTECODE_CACHE_HPP17346
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "lua.hpp"
+
+// a file compiled ahead of time, with the mtime and size of the source it was compiled from.
+struct CompiledChunk {
+  std::string path;
+  std::int64_t mtime;
+  std::uint64_t size;
+  std::string code;
+};
+
+// Caches compiled chunks on disk so module.lua and shared lib files are only parsed again when
+// they change. Entries are keyed by source path and validated against the source's mtime and size
+// and the Lua version, anything stale or unreadable is recompiled transparently.
+class BytecodeCache {
+public:
+  inline void set_dir(std::filesystem::path dir) { dir_ = std::move(dir); }
+
+  // same contract as luaL_loadfile: pushes the compiled chunk or an error message.
+  int load_file(lua_State* ls, const std::filesystem::path& path);
+  // compiles path and the files its require "name" calls find on search_path (a package.path) into out,
+  // writing their cache entries. Safe to call from any thread, it uses a throwaway lua_State and doesn't
+  // touch the counters. Files that don't compile are left out, loading them reports the error.
+  void precompile(const std::filesystem::path& path, std::string_view search_path,
+                  std::vector<CompiledChunk>& out) const;
+  // chunks that load_file hands out without going to disk, until clear_preloaded.
+  void preload(std::vector<CompiledChunk>& chunks);
+  inline void clear_preloaded() { preloaded_.clear(); }
+  // adds a package.searchers entry in front of the stock Lua file searcher that goes through the cache.
+  void install_searcher(lua_State* ls);
+
+  std::uint64_t hits = 0;
+  std::uint64_t misses = 0;
+
+private:
+  struct Header {
+    char magic[4];
+    std::uint32_t lua_version;
+    std::int64_t mtime;
+    std::uint64_t size;
+  };
+
+  static int searcher(lua_State* ls);
+
+  static Header header_for(std::int64_t mtime, std::uint64_t size);
+  std::filesystem::path entry_path(const std::filesystem::path& source) const;
+  bool read_entry(const std::filesystem::path& entry, const Header& expected, std::string& code) const;
+  void write_entry(const std::filesystem::path& entry, const Header& header, const std::string& code) const;
+  // source gets the file's text, for finding its requires.
+  bool compile_file(lua_State* ls, const std::filesystem::path& path, CompiledChunk& out, std::string& source) const;
+
+  std::filesystem::path dir_;
+  std::string buf_;
+  std::map<std::string, CompiledChunk, std::less<>> preloaded_;
+};
+
+#endif /* !BYTECODE_CACHE_HPP17346 */
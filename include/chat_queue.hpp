@@ -0,0 +1,53 @@
+/*
+ * chat_queue.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef CHAT_QUEUE_HPP40716
+#define CHAT_QUEUE_HPP40716
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Buffers chat output (LOG, DLOG, luna.echo) until the end of the pulse. Lines are formatted straight into
+// one arena, identical consecutive lines are merged into a single "(xN)" line, and anything past the
+// per-frame budget is dropped and counted instead of flooding the chat window.
+class ChatQueue {
+public:
+  using Writer = void (*)(char* line);
+
+  void format(const char* fmt, ...) __attribute__((format(__printf__, 2, 3)));
+  void push(std::string_view line);
+  // hands up to budget lines (0 is unlimited) to write and empties the queue.
+  void flush(std::size_t budget, Writer write);
+  inline bool empty() const { return lines_.empty(); }
+
+  std::uint64_t written = 0;
+  std::uint64_t merged = 0;
+  std::uint64_t dropped = 0;
+
+private:
+  struct Line {
+    std::uint32_t offset;
+    std::uint32_t length;
+    std::uint32_t repeats;
+  };
+
+  // the line at start has just been written to the arena, merges it into the last one if they match.
+  void commit(std::size_t start, std::size_t length);
+
+  // every line is stored nul terminated so it can be handed to MQ2 as is.
+  std::string text_;
+  std::vector<Line> lines_;
+  std::string scratch_;
+};
+
+namespace zx {
+extern ChatQueue chat_queue;
+} // namespace zx
+
+#endif /* !CHAT_QUEUE_HPP40716 */
@@ -0,0 +1,55 @@
+/*
+ * data_cache.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef DATA_CACHE_HPP62870
+#define DATA_CACHE_HPP62870
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+
+#include "lua.hpp"
+
+// the result of an MQ2 data expression, converted to something lua can take.
+struct DataValue {
+  enum class Kind : std::uint8_t { Nil, Integer, Number, String, Boolean };
+
+  void push(lua_State* ls) const;
+
+  Kind kind = Kind::Nil;
+  lua_Integer integer = 0;
+  lua_Number number = 0;
+  bool boolean = false;
+  std::string string;
+};
+
+// Remembers luna.data results for the rest of the current pulse, keyed by expression string.
+// Invalidation is a generation bump, so entries (and their string buffers) are reused every pulse.
+class DataCache {
+public:
+  // the cached value if expr was evaluated since the last invalidation, otherwise nullptr.
+  const DataValue* find(std::string_view expr);
+  // the slot to evaluate expr into, it counts as cached until the next invalidation.
+  DataValue& store(std::string_view expr);
+  void invalidate();
+  // for values kept outside the map (prepared queries): true if stamp is current, otherwise stamps it.
+  bool fresh(std::uint64_t& stamp);
+
+  std::uint64_t hits = 0;
+  std::uint64_t misses = 0;
+
+private:
+  struct Entry {
+    std::uint64_t generation = 0;
+    DataValue value;
+  };
+
+  std::map<std::string, Entry, std::less<>> entries_;
+  std::uint64_t generation_ = 1;
+};
+
+#endif /* !DATA_CACHE_HPP62870 */
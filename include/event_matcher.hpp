@@ -0,0 +1,152 @@
+/*
+ * event_matcher.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef EVENT_MATCHER_HPP40217
+#define EVENT_MATCHER_HPP40217
+
+#include <bitset>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "literal_scanner.hpp"
+
+struct LunaContext;
+
+// which patterns matched a line, and where in the line each of their capture groups is.
+struct EventMatches {
+  struct Hit {
+    int pattern_id;
+    std::uint32_t first_capture;
+    std::uint32_t capture_count;
+  };
+  struct Capture {
+    std::uint32_t offset;
+    std::uint32_t length;
+  };
+
+  inline bool empty() const { return hits.empty(); }
+  inline void clear() {
+    hits.clear();
+    captures.clear();
+  }
+
+  std::vector<Hit> hits;
+  std::vector<Capture> captures;
+};
+
+// Matches a chat line against every event pattern of every module in a single pass.
+//
+// Patterns are compiled into one Thompson NFA which is walked as a lazily built DFA, so the
+// cost per line is one table lookup per byte no matter how many patterns are registered.
+// Patterns using regex features the automaton doesn't understand (backreferences, lookahead,
+// word boundaries, ...) fall back to std::regex_match.
+//
+// In front of both sits a literal prefilter: every pattern's longest required literal is indexed
+// in a LiteralScanner, and a pattern is only considered for a line if its literal occurs in it.
+class EventMatcher {
+public:
+  struct Pattern {
+    LunaContext* ctx;
+    int fn_key;
+    std::string source;
+    std::regex re;
+    // empty if the pattern has no literal every match must contain.
+    std::string literal;
+    bool in_automaton = false;
+    bool live = true;
+
+    std::uint64_t lines_at_add = 0;
+    std::uint64_t prefilter_passes = 0;
+    std::uint64_t matches = 0;
+  };
+
+  struct PatternStats {
+    std::uint64_t passed;
+    std::uint64_t rejected;
+    std::uint64_t matched;
+  };
+
+  // returns the id of the new pattern, it stays valid until the next compact.
+  int add(LunaContext* ctx, int fn_key, std::string_view source);
+  // the context's patterns stop matching, but keep their ids until compact.
+  void remove_context(const LunaContext* ctx);
+  // drops the patterns of removed contexts and renumbers the rest, in the same order. Only safe while
+  // nothing holds on to a pattern id, such as queued matches.
+  void compact();
+  void clear();
+
+  // fills hits with the ids of every live pattern matching the entire line, in registration order.
+  void match(std::string_view line, std::vector<int>& hits);
+  // same as match, but also records capture offsets so handlers can be called without matching again.
+  void match(std::string_view line, EventMatches& out);
+
+  inline const Pattern& pattern(int id) const { return patterns_[id]; }
+  inline std::size_t pattern_count() const { return patterns_.size(); }
+  PatternStats stats(int id) const;
+  inline std::size_t dfa_state_count() const { return dfa_.size(); }
+
+private:
+  struct NfaState {
+    enum class Kind : std::uint8_t { Set, Split, Match };
+    Kind kind;
+    int out = -1;
+    int out1 = -1;
+    // char set index for Set, pattern id for Match
+    int arg = -1;
+  };
+
+  struct DfaState {
+    std::vector<int> nfa;
+    std::vector<int> accepts;
+  };
+
+  bool compile(int id);
+  void rebuild();
+  void rebuild_prefilter();
+  void flush_dfa();
+  void next_visit_gen();
+  void add_closure(int nfa_idx, std::vector<int>& out);
+  int dfa_state_for(std::vector<int>& nfa_set);
+  int start_state();
+  int step(int dfa_idx, unsigned char c);
+
+  std::deque<Pattern> patterns_;
+
+  LiteralScanner scanner_;
+  bool prefilter_dirty_ = false;
+  std::size_t dead_patterns_ = 0;
+  std::uint64_t lines_scanned_ = 0;
+  // pattern ids by literal id
+  std::vector<std::vector<int>> literal_patterns_;
+  // live patterns without a literal, these are candidates for every line.
+  std::vector<int> unfiltered_ids_;
+  bool unfiltered_in_automaton_ = false;
+  std::vector<int> found_literals_;
+  std::vector<int> candidate_ids_;
+
+  std::vector<NfaState> nfa_;
+  std::vector<std::bitset<256>> sets_;
+  std::vector<int> roots_;
+
+  std::vector<DfaState> dfa_;
+  // 256 transitions per dfa state, -1 when not computed yet
+  std::vector<int> transitions_;
+  std::map<std::vector<int>, int> dfa_index_;
+  int start_ = -1;
+  std::vector<std::uint32_t> visit_marks_;
+  std::uint32_t visit_gen_ = 0;
+  std::vector<int> scratch_set_;
+  std::vector<int> closure_stack_;
+  std::vector<int> hit_ids_;
+  std::cmatch capture_match_;
+};
+
+#endif /* !EVENT_MATCHER_HPP40217 */
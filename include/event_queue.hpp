@@ -0,0 +1,65 @@
+/*
+ * event_queue.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef EVENT_QUEUE_HPP83125
+#define EVENT_QUEUE_HPP83125
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "event_matcher.hpp"
+
+// Ring buffer of matched chat lines waiting for the next pulse. Line text lives in fixed size slots of
+// one preallocated arena and each slot keeps its EventMatches around, so once the slots have warmed
+// up queueing a line doesn't allocate. What happens when it's full is up to the overflow policy.
+class EventQueue {
+public:
+  enum class Overflow : std::uint8_t { DropOldest, DropNewest, Grow };
+
+  struct Stats {
+    std::uint64_t enqueued = 0;
+    std::uint64_t dropped = 0;
+    std::size_t high_water = 0;
+  };
+
+  // longest line a slot holds, longer ones are dropped. chat lines never come close.
+  static constexpr std::size_t slot_bytes = 2048;
+
+  // queued lines are kept (the oldest ones go if they no longer fit).
+  void reserve(std::size_t capacity, Overflow overflow);
+  // false if the line was dropped.
+  bool push(std::string_view line, const EventMatches& matches);
+  std::string_view front_line() const;
+  const EventMatches& front_matches() const;
+  void pop();
+
+  inline bool empty() const { return size_ == 0; }
+  inline std::size_t size() const { return size_; }
+  inline std::size_t capacity() const { return slots_.size(); }
+  inline Overflow overflow() const { return overflow_; }
+  inline const Stats& stats() const { return stats_; }
+
+private:
+  struct Slot {
+    std::uint32_t length = 0;
+    EventMatches matches;
+  };
+
+  inline char* slot_text(std::size_t i) const { return arena_.get() + i * slot_bytes; }
+  void relayout(std::size_t capacity);
+
+  std::unique_ptr<char[]> arena_;
+  std::vector<Slot> slots_;
+  std::size_t head_ = 0;
+  std::size_t size_ = 0;
+  Overflow overflow_ = Overflow::DropOldest;
+  Stats stats_;
+};
+
+#endif /* !EVENT_QUEUE_HPP83125 */
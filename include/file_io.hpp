@@ -0,0 +1,78 @@
+/*
+ * file_io.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef FILE_IO_HPP40382
+#define FILE_IO_HPP40382
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Serves luna.fs on a background thread so a module never waits on the disk during a pulse. Paths are
+// resolved by the caller and requests only carry bytes. Appends to one file that are queued together are
+// written with a single open and write, and the requests for any one file complete in the order they were
+// made. Writes still queued when it's destroyed are finished first.
+class FileIo {
+public:
+  enum class Op : std::uint8_t { Read, Write, Append };
+
+  struct Request {
+    // the context is referred to by id, it may be gone by the time the request is done.
+    std::uint32_t ctx_id;
+    std::uint64_t id;
+    Op op;
+    std::filesystem::path path;
+    // where a read looks when path doesn't exist, empty for nowhere.
+    std::filesystem::path fallback;
+    std::string data;
+  };
+
+  struct Result {
+    std::uint32_t ctx_id;
+    std::uint64_t id;
+    Op op;
+    bool ok;
+    // the contents for a read, otherwise empty, or the error message.
+    std::string data;
+  };
+
+  FileIo() = default;
+  ~FileIo();
+  FileIo(const FileIo& other) = delete;
+  FileIo& operator=(const FileIo& other) = delete;
+
+  std::uint64_t submit(std::uint32_t ctx_id, Op op, std::filesystem::path path, std::filesystem::path fallback,
+                       std::string data);
+  // moves the finished requests into out.
+  void drain(std::vector<Result>& out);
+  inline std::size_t pending() const { return pending_; }
+  // appends that went out with an earlier append to the same file instead of on their own.
+  inline std::uint64_t batched_appends() const { return batched_appends_; }
+
+private:
+  void run();
+  void process(std::vector<Request>& batch, std::vector<Result>& done);
+
+  std::thread thread_;
+  std::uint64_t last_id_ = 0;
+  // requests submitted whose results haven't been drained yet, game thread only.
+  std::size_t pending_ = 0;
+  std::atomic<std::uint64_t> batched_appends_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::vector<Request> requests_;
+  std::vector<Result> results_;
+  bool stopping_ = false;
+};
+
+#endif /* !FILE_IO_HPP40382 */
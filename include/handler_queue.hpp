@@ -0,0 +1,71 @@
+/*
+ * handler_queue.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef HANDLER_QUEUE_HPP71804
+#define HANDLER_QUEUE_HPP71804
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "event_matcher.hpp"
+#include "luna_config.hpp"
+
+struct LunaContext;
+
+// Event and bind handler calls waiting for their module's priority class to get its turn in the frame.
+// Lines, bind arguments and captures are copied into arenas that are reused every frame. Calls that don't
+// fit the frame budget are carried over into the other set of arenas, which becomes the current one on
+// the next begin_frame, ahead of anything queued after it.
+class HandlerQueue {
+public:
+  struct Call {
+    LunaContext* ctx;
+    int fn_key;
+    bool event;
+    // the event line or the bind arguments.
+    std::uint32_t text_offset;
+    std::uint32_t text_length;
+    std::uint32_t first_capture;
+    std::uint32_t capture_count;
+    // frames in a row it has been carried over.
+    std::uint32_t waited;
+  };
+
+  void begin_frame();
+  void add_event(LunaContext* ctx, int fn_key, std::string_view line, const EventMatches::Capture* captures,
+                 std::uint32_t capture_count);
+  void add_bind(LunaContext* ctx, int fn_key, std::string_view args);
+  // into the next frame, call is from this one.
+  void carry_over(const Call& call);
+  // this frame's calls for modules of the given priority, in the order they were queued.
+  inline const std::vector<Call>& calls(Priority priority) const {
+    return current_.calls[std::size_t(priority)];
+  }
+  inline std::string_view text(const Call& call) const {
+    return {current_.text.data() + call.text_offset, call.text_length};
+  }
+  inline const EventMatches::Capture* captures(const Call& call) const {
+    return current_.captures.data() + call.first_capture;
+  }
+  void remove_context(const LunaContext* ctx);
+
+private:
+  struct Frame {
+    std::string text;
+    std::vector<EventMatches::Capture> captures;
+    std::array<std::vector<Call>, std::size_t(Priority::Count)> calls;
+  };
+
+  static void add(Frame& frame, const Call& call, std::string_view text, const EventMatches::Capture* captures);
+
+  Frame current_;
+  Frame next_;
+};
+
+#endif /* !HANDLER_QUEUE_HPP71804 */
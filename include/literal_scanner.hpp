@@ -0,0 +1,42 @@
+/*
+ * literal_scanner.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef LITERAL_SCANNER_HPP83302
+#define LITERAL_SCANNER_HPP83302
+
+#include <bitset>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// Finds which of a set of literal strings occur anywhere in a line, in one pass (Aho-Corasick).
+//
+// The automaton is stored as a dense transition table. While sitting in the root state the scan
+// skips ahead over bytes that can't start any literal, which is where most of the time goes on
+// chat lines that don't contain any of the literals.
+class LiteralScanner {
+public:
+  // literal ids are indices into literals. empty literals are ignored.
+  void build(const std::vector<std::string_view>& literals);
+  void clear();
+
+  // appends the id of every literal found in text, each at most once.
+  void scan(std::string_view text, std::vector<int>& found);
+
+  inline bool empty() const { return next_.empty(); }
+
+private:
+  // 256 transitions per state, state 0 is the root.
+  std::vector<std::uint16_t> next_;
+  std::bitset<256> starts_;
+  // literals ending at state s are out_ids_[out_begin_[s]..out_begin_[s + 1]]
+  std::vector<std::uint32_t> out_begin_;
+  std::vector<int> out_ids_;
+  std::vector<std::uint32_t> seen_marks_;
+  std::uint32_t seen_gen_ = 0;
+};
+
+#endif /* !LITERAL_SCANNER_HPP83302 */
@@ -9,28 +9,32 @@
 
 #include <chrono>
 #include <cstdint>
+#include <deque>
 #include <filesystem>
 #include <map>
 #include <memory>
 #include <string_view>
 #include <vector>
 
+#include "bind_router.hpp"
+#include "bytecode_cache.hpp"
+#include "chat_queue.hpp"
+#include "data_cache.hpp"
+#include "event_matcher.hpp"
+#include "event_queue.hpp"
+#include "file_io.hpp"
+#include "handler_queue.hpp"
+#include "luna_config.hpp"
 #include "luna_context.hpp"
 #include "luna_defs.hpp"
+#include "utils.hpp"
 
 namespace fs = std::filesystem;
 
-namespace zx {
-extern char scratch_buf[4096];
-static_assert(sizeof(scratch_buf) == 4096);
-} // namespace zx
-
 #ifndef LOG
 #define LOG(fmt_string, ...)                                                                                           \
   do {                                                                                                                 \
-    std::snprintf(::zx::scratch_buf, sizeof(::zx::scratch_buf),                                                        \
-                  "\ag[Luna]\ax " fmt_string __VA_OPT__(, ) __VA_ARGS__);                                              \
-    mq2->WriteChatColor(::zx::scratch_buf);                                                                            \
+    ::zx::chat_queue.format("\ag[Luna]\ax " fmt_string __VA_OPT__(, ) __VA_ARGS__);                                    \
   } while (false);
 #endif
 
@@ -38,13 +42,29 @@ static_assert(sizeof(scratch_buf) == 4096);
 #define DLOG(fmt_string, ...)                                                                                          \
   do {                                                                                                                 \
     if (::luna->debug_enabled()) {                                                                                     \
-      std::snprintf(::zx::scratch_buf, sizeof(::zx::scratch_buf),                                                      \
-                    "\ay[Luna:Debug]\ax " fmt_string __VA_OPT__(, ) __VA_ARGS__);                                      \
-      mq2->WriteChatColor(::zx::scratch_buf);                                                                          \
+      ::zx::chat_queue.format("\ay[Luna:Debug]\ax " fmt_string __VA_OPT__(, ) __VA_ARGS__);                            \
     }                                                                                                                  \
   } while (false);
 #endif
 
+struct ScheduledPulse {
+  std::chrono::steady_clock::time_point wake;
+  LunaContext* ctx;
+  // entries whose gen doesn't match the context's schedule_gen are stale and skipped.
+  std::uint32_t gen;
+};
+
+// a module from /luna run or autostart whose files are being compiled on the worker threads.
+struct PendingRun {
+  std::string name;
+  // 0 when there's nothing to compile, it just waits its turn.
+  std::uint64_t job_id;
+  bool compiled;
+  // frames it has been compiling for, the workers may be tied up with luna.async jobs.
+  std::uint32_t frames_waited;
+  std::vector<CompiledChunk> chunks;
+};
+
 class Luna {
 public:
   Luna();
@@ -64,38 +84,108 @@ public:
   void Cmd(const char* cmd);
   void BoundCommand(const char* cmd);
   inline bool in_pulse() const { return in_pulse_; }
+  // the clock is read once at the start of each pulse.
+  inline std::chrono::steady_clock::time_point frame_time() const { return frame_time_; }
   int add_bind(lua_State* ls);
+  int add_event(lua_State* ls);
+  // nullptr unless cache_data is set in the config.
+  inline DataCache* data_cache() { return config_.cache_data ? &data_cache_ : nullptr; }
+  inline void invalidate_data_cache() { data_cache_.invalidate(); }
+
+  // a handler suspended or a task was spawned, the context may now be due before its heap entry.
+  void reschedule_if_needed(LunaContext* ctx);
+
+  inline WorkerPool& workers() { return workers_; }
+  inline FileIo& file_io() { return file_io_; }
+  inline const fs::path& luna_dir() const { return modules_dir; }
 
   inline bool debug_enabled() { return debug_; }
 private:
   void print_info();
+  void print_event_stats();
   void print_help();
   void list_available_modules();
 
+  // space separated names or "all", each is compiled ahead on the worker threads and started in order.
+  void run_modules(std::string_view names);
+  void queue_module(const std::string& name);
+  void start_compiled_modules();
   void run_module(std::string_view sv);
+  std::string search_path_for(const fs::path& module_dir) const;
   void stop_module(std::string_view sv);
   void pause_module(std::string_view sv);
+  void profile_command(std::string_view sv);
+  void write_profile(LunaContext& ctx);
+  void bench_command(std::string_view sv);
+  void record_command(std::string_view sv);
+  // module name, reset [module] or dump [file], nothing shows every module.
+  void stats_command(std::string_view sv);
+  void print_stats(const LunaContext& ctx, bool all_hooks);
+  void write_stats(std::string_view file);
 
   int find_index_of(std::string_view ctx_name);
+  // nullptr if the module has been stopped since.
+  LunaContext* find_context(std::uint32_t id);
 
   void load_config();
   void save_config();
 
-  void do_binds();
-  void do_events();
+  // move what was queued before this pulse into handler_queue_, by the priority of the module it's for.
+  void queue_binds();
+  void queue_events();
+  // the frame's handler calls and due pulses of one priority class, as far as the budget allows.
+  void run_handlers(Priority priority, std::chrono::steady_clock::time_point frame_start);
+  void run_pulses(Priority priority, std::chrono::steady_clock::time_point frame_start);
+  bool over_budget(std::chrono::steady_clock::time_point frame_start) const;
   void do_luna_commands();
+  void deliver_async_results();
+  // spends what's left of the frame budget after frame_start on module collectors.
+  void step_collectors(std::chrono::steady_clock::time_point frame_start);
 
   void cleanup_exiting_contexts();
+  PreparedState take_prepared_state();
+  // adds a state to the pool if it's short and the frame started at frame_start is still within budget.
+  void refill_state_pool(std::chrono::steady_clock::time_point frame_start);
+  void flush_chat(std::size_t budget);
+  void schedule_pulse(LunaContext* ctx, std::chrono::steady_clock::time_point wake);
+  void unschedule_pulse(LunaContext* ctx);
+  void pop_due_pulses(std::chrono::steady_clock::time_point now);
+  // drops everything Luna tracks on behalf of ctx, must be called before ctx is destroyed.
+  void unregister_context(LunaContext* ctx);
 
   bool in_pulse_ = false;
   bool debug_ = false;
+  LunaConfig config_;
+  std::chrono::steady_clock::time_point frame_time_ = zx::now();
 
   std::vector<std::unique_ptr<LunaContext>> luna_ctxs_;
   fs::path modules_dir;
-  std::vector<std::string> todo_bind_commands_;
-  std::vector<std::string> todo_events_;
+  CommandArena todo_bind_commands_;
+  BindRouter bind_router_;
+  EventQueue todo_events_;
+  // events and binds are copied out of their queues, handlers may push more while they run.
+  HandlerQueue handler_queue_;
+  std::uint64_t frames_ = 0;
+  std::uint64_t over_budget_frames_ = 0;
   std::vector<std::string> todo_luna_cmds_;
-  // std::map<std::string, std::pair<LunaContext*, int>, std::less<>> bound_command_map_;
+  EventMatcher event_matcher_;
+  BytecodeCache bytecode_cache_;
+  DataCache data_cache_;
+  std::vector<PreparedState> state_pool_;
+  WorkerPool workers_;
+  std::vector<WorkerPool::Result> async_results_;
+  std::deque<PendingRun> pending_runs_;
+  FileIo file_io_;
+  std::vector<FileIo::Result> file_results_;
+  std::uint32_t last_ctx_id_ = 0;
+  EventMatches intake_matches_;
+  // min-heap on wake time, only running contexts with a pulse function are in it.
+  std::vector<ScheduledPulse> pulse_heap_;
+  std::vector<LunaContext*> due_pulses_;
+  // the order collectors are stepped in this frame, and where the next frame starts looking.
+  std::vector<LunaContext*> gc_idle_;
+  std::vector<LunaContext*> gc_busy_;
+  std::size_t gc_cursor_ = 0;
 };
 
 extern Luna* luna;
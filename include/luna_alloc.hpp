@@ -0,0 +1,94 @@
+/*
+ * luna_alloc.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef LUNA_ALLOC_HPP55120
+#define LUNA_ALLOC_HPP55120
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// lua_Alloc for a single module's lua_State.
+//
+// Small blocks come from per-size-class free lists carved out of chunks owned by the allocator,
+// so the churn of tiny same-sized objects never reaches the system heap and any fragmentation is
+// confined to the module. Everything is released at once when the allocator is destroyed, which
+// must happen after lua_close.
+//
+// A refused request is raised by Lua as a memory error, and outside a protected call that ends in
+// the panic handler and abort(). So the limit is only enforced while an Armed guard is alive, which
+// callers put around their lua_pcall and lua_resume. Whatever Luna allocates in between is counted
+// but never refused.
+class LunaAllocator {
+public:
+  struct Stats {
+    std::size_t current_bytes;
+    std::size_t peak_bytes;
+    std::size_t chunk_bytes;
+    std::uint64_t allocations;
+    std::uint64_t frees;
+    std::uint64_t refusals;
+  };
+
+  LunaAllocator() = default;
+  ~LunaAllocator();
+  LunaAllocator(const LunaAllocator& other) = delete;
+  LunaAllocator& operator=(const LunaAllocator& other) = delete;
+
+  class Armed {
+  public:
+    explicit Armed(LunaAllocator& allocator)
+        : allocator_{allocator}, was_armed_{std::exchange(allocator.armed_, true)} {}
+    ~Armed() { allocator_.armed_ = was_armed_; }
+    Armed(const Armed& other) = delete;
+    Armed& operator=(const Armed& other) = delete;
+
+  private:
+    LunaAllocator& allocator_;
+    bool was_armed_;
+  };
+
+  static void* alloc(void* ud, void* ptr, std::size_t osize, std::size_t nsize);
+
+  // requests that would grow the state past limit bytes fail while armed, 0 is unlimited.
+  inline void set_limit(std::size_t limit) { limit_ = limit; }
+  inline std::size_t limit() const { return limit_; }
+  Stats stats() const;
+
+private:
+  static constexpr std::size_t granularity = 8;
+  static constexpr std::size_t max_small = 256;
+  static constexpr std::size_t num_classes = max_small / granularity;
+  static constexpr std::size_t chunk_size = 64 * 1024;
+
+  static inline std::size_t class_of(std::size_t n) { return (n + granularity - 1) / granularity - 1; }
+
+  void* allocate(std::size_t n);
+  void release(void* p, std::size_t n);
+  void* reallocate(void* p, std::size_t osize, std::size_t nsize);
+  void* carve(std::size_t cls);
+
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  std::array<FreeBlock*, num_classes> free_lists_{};
+  std::vector<void*> chunks_;
+  char* chunk_cur_ = nullptr;
+  char* chunk_end_ = nullptr;
+
+  std::size_t limit_ = 0;
+  bool armed_ = false;
+  std::size_t current_ = 0;
+  std::size_t peak_ = 0;
+  std::uint64_t allocations_ = 0;
+  std::uint64_t frees_ = 0;
+  std::uint64_t refusals_ = 0;
+};
+
+#endif /* !LUNA_ALLOC_HPP55120 */
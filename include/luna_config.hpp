@@ -0,0 +1,73 @@
+/*
+ * luna_config.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef LUNA_CONFIG_HPP30982
+#define LUNA_CONFIG_HPP30982
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "event_queue.hpp"
+
+// settings that luna_config.lua can set globally and override in its modules table, e.g.
+//   memory_limit_kb = 8192
+//   modules = { fish = { memory_limit_kb = 1024 } }
+enum class GcMode : std::uint8_t { Incremental, Generational };
+// the order modules get their turn in a frame, a class's events, binds and pulses all come before the next's.
+enum class Priority : std::uint8_t { Combat, Utility, Cosmetic, Count };
+
+struct ModuleConfig {
+  // 0 is unlimited
+  std::size_t memory_limit_kb = 0;
+  // event and bind handlers that may be waiting in luna.yield at once.
+  std::size_t max_suspended_handlers = 32;
+  // "combat", "utility" or "cosmetic".
+  Priority priority = Priority::Utility;
+  // gc_mode is "incremental" or "generational". The collector's own steps are made lazier than lua's
+  // defaults (pause 200, minor multiplier 20) since Luna steps it in idle frame time.
+  GcMode gc_mode = GcMode::Incremental;
+  int gc_pause = 400;
+  int gc_stepmul = 100;
+  int gc_minor_mul = 40;
+};
+
+struct LunaConfig {
+  // lua_States kept ready for /luna run, refilled one per pulse. Numbers in luna_config.lua that are out of
+  // range for a setting, such as negative sizes, are clamped and logged.
+  std::size_t state_pool_size = 2;
+  // matched chat lines waiting for the next pulse, event_queue_overflow is "drop_oldest", "drop_newest" or "grow".
+  std::size_t event_queue_size = 256;
+  EventQueue::Overflow event_queue_overflow = EventQueue::Overflow::DropOldest;
+  // threads running luna.async jobs (0 disables it), each job's state is capped at async_memory_limit_kb.
+  std::size_t async_workers = 2;
+  std::size_t async_memory_limit_kb = 64 * 1024;
+  // chat output is queued during a pulse, lines past this are dropped at the end of it. 0 is unlimited.
+  std::size_t chat_lines_per_frame = 100;
+  // Luna's share of a frame. Events, binds and pulses that don't fit are put off to the next frame, lower
+  // priority modules first, but never more than max_deferred_frames frames in a row. What's left after
+  // them is spent stepping module collectors gc_step_kb at a time, sleeping and paused modules first.
+  // 0 is unlimited, nothing is put off and there's no idle stepping.
+  std::size_t frame_budget_us = 2000;
+  std::uint32_t max_deferred_frames = 8;
+  std::size_t gc_step_kb = 16;
+  // remember luna.data results until the next pulse (or zone or luna.do_command).
+  bool cache_data = false;
+  // modules started when the plugin loads, in order: autostart = { "buffs", "fish" }
+  std::vector<std::string> autostart;
+  ModuleConfig defaults;
+  std::map<std::string, ModuleConfig, std::less<>> modules;
+
+  inline const ModuleConfig& for_module(std::string_view name) const {
+    auto it = modules.find(name);
+    return it == modules.end() ? defaults : it->second;
+  }
+};
+
+#endif /* !LUNA_CONFIG_HPP30982 */
@@ -7,13 +7,22 @@
 #ifndef LUNA_STATE_HPP61451
 #define LUNA_STATE_HPP61451
 
+#include "event_matcher.hpp"
+#include "file_io.hpp"
 #include "lua.hpp"
+#include "luna_alloc.hpp"
+#include "luna_config.hpp"
 #include "luna_defs.hpp"
+#include "module_stats.hpp"
+#include "worker_pool.hpp"
 #include <algorithm>
+#include <chrono>
 #include <cstdint>
+#include <filesystem>
 #include <map>
-#include <regex>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 struct EventKeys {
@@ -37,9 +46,62 @@ struct LuaThreads {
   lua_State* bind;
 };
 
+struct PulseBudget {
+  // how long a single resume of the pulse coroutine may run before it's preempted, 0 is unlimited.
+  lua_Integer instructions = 0;
+  lua_Integer microseconds = 0;
+  // instructions the module may run without yielding or returning before it's stopped, 0 is unlimited.
+  lua_Integer watchdog = 0;
+};
+
+// a coroutine kept around for handlers, anchored in the registry so it isn't collected while idle.
+struct PooledThread {
+  lua_State* thread = nullptr;
+  int ref = LUA_NOREF;
+};
+
+// a coroutine the context schedules next to its pulse function: an event or bind handler that
+// yielded, or a task started with luna.spawn.
+struct Task {
+  PooledThread co;
+  // "event", "bind" or "task", or what a callback is for: "async" or "fs"
+  const char* kind = nullptr;
+  std::uint32_t id = 0;
+  // arguments waiting on the thread's stack for the first resume.
+  int start_args = 0;
+  bool cancelled = false;
+  std::chrono::steady_clock::time_point wake;
+  std::chrono::steady_clock::duration cpu_time{};
+  // where the spawned function was defined, for /luna info.
+  std::string source;
+};
+
+struct TaskWake {
+  std::chrono::steady_clock::time_point wake;
+  // entries for tasks that have finished or were cancelled are skipped.
+  std::uint32_t id;
+};
+
+class BytecodeCache;
+
+// a lua_State with the standard libs, the bytecode cache searcher and the luna table already
+// installed, but not yet bound to a module.
+struct PreparedState {
+  PreparedState() = default;
+  ~PreparedState();
+  PreparedState(PreparedState&& other) noexcept;
+  PreparedState& operator=(PreparedState&& other) noexcept;
+
+  // allocator is heap allocated since the lua_State holds on to its address.
+  std::unique_ptr<LunaAllocator> allocator;
+  lua_State* main = nullptr;
+};
+
 constexpr const char* module_global = "luna_module";
 struct LunaContext {
-  LunaContext(const std::string& name);
+  LunaContext(const std::string& name, PreparedState state);
+  // open_luna pushes the luna table, it's also what require("luna") returns.
+  static PreparedState prepare_state(lua_CFunction open_luna, BytecodeCache& cache);
   ~LunaContext();
   // If this is ever allowed need to add functions to update the stored ctx ptr in the registry
   LunaContext(const LunaContext& other) = delete;
@@ -47,45 +109,172 @@ struct LunaContext {
   LunaContext& operator=(const LunaContext& other) = delete;
   const LunaContext& operator=(LunaContext&& other) = delete;
 
-  void add_command_binding(lua_State* ls);
-  void add_event_binding(lua_State* ls);
-  bool has_command_binding(std::string_view command) const;
-  void do_command_bind(std::vector<std::string_view> args);
-  void do_event(const std::string& event_line);
-  bool matches_event(const char* event_line) const;
+  // both return the registry key of the handler, or LUA_NOREF on failure.
+  int add_command_binding(lua_State* ls);
+  int add_event_binding(lua_State* ls);
+  // args is the rest of the /ldo line, each space separated word is passed to the handler.
+  void do_command_bind(int fn_key, std::string_view args);
+  void do_event(int fn_key, std::string_view event_line, const EventMatches::Capture* captures,
+                std::uint32_t capture_count);
 
   int yield_event(lua_State* ls);
+  int set_budget(lua_State* ls);
+
+  inline LunaAllocator::Stats memory_stats() const { return allocator_->stats(); }
+  inline std::size_t memory_limit() const { return allocator_->limit(); }
+  inline void set_memory_limit(std::size_t bytes) { allocator_->set_limit(bytes); }
+  // the limit is enforced while the guard lives, only hold it around calls that catch Lua errors.
+  [[nodiscard]] inline LunaAllocator::Armed arm_memory_limit() { return LunaAllocator::Armed{*allocator_}; }
+
+  void configure_gc(const ModuleConfig& conf);
+  // a cycle is under way, or the heap grew by slack bytes since the last one finished.
+  bool gc_wanted(std::size_t slack) const;
+  // an explicit collector step worth kb of allocation, true once there's nothing left to collect for now.
+  bool gc_step(int kb);
+
+  void start_profile();
+  // stops sampling and hands over the folded stacks collected so far.
+  std::unordered_map<std::string, std::uint64_t> stop_profile();
+  inline bool profiling() const { return profiling_; }
 
   std::string name;
+  // the module's directory, relative luna.fs paths start here.
+  std::filesystem::path dir;
+  // assigned by Luna, never reused, for work that finishes after the context may be gone.
+  std::uint32_t id = 0;
   LuaThreads threads_;
   bool pulse_yielding = false;
   bool paused = false;
 
   std::chrono::steady_clock::time_point sleep_time;
+  std::uint32_t schedule_gen = 0;
+  std::uint64_t preemptions = 0;
+  ModuleStats stats;
+  Priority priority = Priority::Utility;
+  // frames in a row its due pulse was put off for being over the frame budget.
+  std::uint32_t deferred_frames = 0;
+  // handlers that may be suspended at once, past that they run to completion and can't yield.
+  std::size_t max_suspended_handlers = 32;
+  // set when a handler suspended, Luna has to look at next_wake again.
+  bool reschedule = false;
 
   bool exiting = false;
 
   void set_search_path(const char* path);
   bool create_indices();
   static const char* get_context_name(lua_State* ls);
+  // the context owning ls without a registry lookup, nullptr for states that aren't a module's.
+  static inline LunaContext* of(lua_State* ls) { return *static_cast<LunaContext**>(lua_getextraspace(ls)); }
 
-  void pulse();
+  inline bool wants_pulse() const { return !exiting && !paused && (keys_.pulse != LUA_NOREF || !tasks_.empty()); }
+  // when the pulse function or a suspended handler is next due, never earlier than now.
+  std::chrono::steady_clock::time_point next_wake(std::chrono::steady_clock::time_point now);
+  inline std::size_t suspended_handlers() const { return suspended_handlers_; }
+  inline const std::unordered_map<std::uint32_t, Task>& tasks() const { return tasks_; }
+  // luna.spawn(fn, ...) starts fn on its own coroutine next pulse and returns the task id.
+  int spawn(lua_State* ls);
+  // luna.cancel(id), true if the task was still alive.
+  int cancel(lua_State* ls);
+  // luna.async(fn_or_source [, args] [, callback]): without a callback the calling coroutine waits for
+  // the results, with one it's called as callback(ok, results or error) and the job id is returned.
+  int async(lua_State* ls, WorkerPool& pool);
+  void complete_async(const WorkerPool::Result& result);
+  // luna.fs.read_async(path [, callback]), write_async and append_async(path, data [, callback]), waited on
+  // like luna.async. Relative paths are in dir, reads that don't find them there look in shared_dir.
+  int file_request(lua_State* ls, FileIo& io, FileIo::Op op, const std::filesystem::path& shared_dir);
+  void complete_file(const FileIo::Result& result);
+  // resumes the handlers that are due, then the pulse function if it is.
+  void pulse(std::chrono::steady_clock::time_point now);
   void zoned();
   void reload_ui();
   void draw_hud();
   void set_game_state(GameState game_state);
 
 private:
-  std::vector<std::regex> event_regexes_;
-  std::vector<int> event_fn_keys_;
-  std::map<std::string, int, std::less<>> bound_command_map_;
+  // must outlive the lua_State, which is closed explicitly in the destructor.
+  std::unique_ptr<LunaAllocator> allocator_;
 
-  void call_registry_fn(int key, const char* fn_name, lua_State* thread);
+  void call_registry_fn(int key, StatsHook hook, lua_State* thread);
+  // counts GC cycles: a finalized object that is replaced by a new one each time it's collected.
+  void install_gc_sentinel();
+  static int gc_sentinel(lua_State* ls);
+
+  // calls the handler at fn_key on a pooled coroutine, or on shared if too many are suspended already.
+  // push_args pushes the arguments onto the thread it's given and returns how many there are.
+  template <typename PushArgs>
+  void run_handler(int fn_key, const char* kind, lua_State* shared, PushArgs push_args);
+  void resume_task(Task& task, int nargs);
+  void end_task(Task& task);
+  void resume_due_tasks(std::chrono::steady_clock::time_point now);
+  void report_error(lua_State* thread, const char* kind, int status);
+  // runs push(thread) in a protected call with the memory limit armed, and returns how many values it left on
+  // the stack or -1 if it raised an error. thread can't be a suspended coroutine.
+  template <typename Push>
+  int push_protected(lua_State* thread, Push& push);
+  // an idle coroutine, or a new one. Its thread is nullptr if there wasn't enough memory to create it.
+  PooledThread acquire_thread();
+  void release_thread(PooledThread co);
+  inline bool hook_handlers() const { return budget_.watchdog > 0 || profiling_; }
+
+  static void count_hook(lua_State* ls, lua_Debug* ar);
+  void on_count_hook(lua_State* ls, lua_Debug* ar);
+  void update_hooks();
+  void sample_stack(lua_State* ls);
 
   void exit_fn();
+  void out_of_memory();
 
   EventKeys keys_;
   bool did_exit_ = false;
+
+  PulseBudget budget_;
+  bool preempted_ = false;
+  // set once the watchdog stopped the module, the hook keeps raising it in case a pcall caught it.
+  std::string watchdog_error_;
+  lua_Integer slice_instructions_ = 0;
+  std::chrono::steady_clock::time_point slice_start_;
+  // instructions run since the pulse coroutine last yielded on its own, or since a handler was called.
+  lua_Integer run_instructions_ = 0;
+  lua_Integer handler_instructions_ = 0;
+
+  // who gets the results of a luna.async job or luna.fs request: a callback, a waiting task, or the pulse
+  // function. Keyed by the job or request id, each source has its own map.
+  struct Waiter {
+    int callback = LUA_NOREF;
+    std::uint32_t task_id = 0;
+  };
+  using Waiters = std::unordered_map<std::uint64_t, Waiter>;
+
+  // errors unless there's a callback at callback_idx or ls is a coroutine that can wait.
+  Waiter make_waiter(lua_State* ls, int callback_idx, const char* what);
+  // returns the id when there's a callback, otherwise suspends ls until complete_waiter resumes it.
+  int await(lua_State* ls, Waiters& waiters, std::uint64_t id, Waiter waiter);
+  // push_results pushes ok followed by the results or the error message and returns how many there are.
+  template <typename PushResults>
+  void complete_waiter(Waiters& waiters, std::uint64_t id, const char* kind, PushResults push_results);
+  static int await_continue(lua_State* ls, int status, lua_KContext kctx);
+
+  std::unordered_map<std::uint32_t, Task> tasks_;
+  Waiters async_waiters_;
+  Waiters file_waiters_;
+  // values waiting on the pulse thread for its next resume.
+  int pulse_resume_args_ = 0;
+  // min-heap on wake time of the tasks, only tasks that are waiting are in it.
+  std::vector<TaskWake> task_heap_;
+  std::vector<TaskWake> due_tasks_;
+  std::vector<PooledThread> idle_threads_;
+  Task* running_task_ = nullptr;
+  std::uint32_t last_task_id_ = 0;
+  std::size_t suspended_handlers_ = 0;
+
+  GcMode gc_mode_ = GcMode::Incremental;
+  bool gc_in_cycle_ = false;
+  std::size_t gc_clean_bytes_ = 0;
+
+  bool profiling_ = false;
+  int profile_countdown_ = 0;
+  std::string profile_key_;
+  std::unordered_map<std::string, std::uint64_t> profile_samples_;
 };
 
 #endif /* !LUNA_STATE_HPP61451 */
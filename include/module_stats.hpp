@@ -0,0 +1,77 @@
+/*
+ * module_stats.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef MODULE_STATS_HPP48263
+#define MODULE_STATS_HPP48263
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Latency histogram with HDR-style buckets: exact below 32ns, then 32 equal buckets for every power of two,
+// so a value is never more than about 3% off its bucket's bound. Fixed size, recording never allocates.
+class LatencyHistogram {
+public:
+  void record(std::chrono::steady_clock::duration d);
+  // the value at or below which fraction p of the recorded values lie, 0 if there are none.
+  std::uint64_t percentile_ns(double p) const;
+  inline std::uint64_t count() const { return count_; }
+  inline std::uint64_t total_ns() const { return total_ns_; }
+  inline std::uint64_t max_ns() const { return max_ns_; }
+  void reset();
+
+private:
+  static constexpr int sub_bits = 5;
+  static constexpr std::uint64_t sub_count = std::uint64_t(1) << sub_bits;
+  // values of 2^max_bits ns (about 68s) and up all land in the last bucket.
+  static constexpr int max_bits = 36;
+  static constexpr std::size_t num_buckets = (max_bits - sub_bits + 1) * sub_count;
+
+  static std::size_t bucket_of(std::uint64_t ns);
+  // the largest value that lands in bucket.
+  static std::uint64_t bucket_limit(std::size_t bucket);
+
+  std::array<std::uint32_t, num_buckets> counts_{};
+  std::uint64_t count_ = 0;
+  std::uint64_t total_ns_ = 0;
+  std::uint64_t max_ns_ = 0;
+};
+
+// what a module's time is measured by: its pulse function, handlers, and the hooks call_registry_fn runs.
+enum class StatsHook : std::uint8_t { Pulse, Event, Bind, Zoned, ReloadUI, DrawHUD, GameStateChanged, Count };
+
+// the name of the module function the hook calls, "pulse", "draw_hud", ...
+const char* stats_hook_name(StatsHook hook);
+
+// what /luna stats shows for a module, counted since it started or the last /luna stats reset.
+struct ModuleStats {
+  ModuleStats();
+  void reset();
+  inline LatencyHistogram& latency(StatsHook hook) { return latency_[std::size_t(hook)]; }
+  inline const LatencyHistogram& latency(StatsHook hook) const { return latency_[std::size_t(hook)]; }
+
+  std::chrono::steady_clock::time_point since;
+  std::uint64_t resumes = 0;
+  // lines that matched one of the module's events, and handler calls for them. Lines dropped by the
+  // event queue are matched but never dispatched.
+  std::uint64_t events_matched = 0;
+  std::uint64_t events_dispatched = 0;
+  // luna.data and its variants, luna.do_command.
+  std::uint64_t data_calls = 0;
+  std::uint64_t commands = 0;
+  // handler calls and pulses put off to the next frame for being over the frame budget.
+  std::uint64_t deferrals = 0;
+  std::uint64_t gc_cycles = 0;
+  // explicit steps in idle frame time, what the collector does on its own during allocation isn't timed.
+  std::uint64_t gc_steps = 0;
+  std::chrono::steady_clock::duration gc_time{};
+
+private:
+  std::array<LatencyHistogram, std::size_t(StatsHook::Count)> latency_;
+};
+
+#endif /* !MODULE_STATS_HPP48263 */
@@ -8,7 +8,11 @@
 #define MQ2_API_HPP51844
 
 #include "mq2_defines.hpp"
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include "win32_compat.hpp"
+#endif
 
 #define PLUGIN_API extern "C" __declspec(dllexport)
 #define EQLIB_API extern "C" __declspec(dllexport)
@@ -156,7 +160,11 @@ public:
   MQ2();
 
   BOOL ParseMQ2DataPortion(const char* data_var, MQ2TypeVar& result);
+  // parses straight out of buf, which MQ2 may scribble over, instead of copying it to scratch first.
+  BOOL ParseMQ2DataPortionInPlace(PCHAR buf, MQ2TypeVar& result);
   VOID WriteChatColor(const char* Line, DWORD Color = USERCOLOR_DEFAULT, DWORD Filter = 0);
+  // for lines that are already in writable storage, skips the copy to scratch.
+  VOID WriteChatColorInPlace(PCHAR Line, DWORD Color = USERCOLOR_DEFAULT, DWORD Filter = 0);
 
   void DoCommand(PSPAWNINFO pChar, const char* cmd);
   void DoCommand(const char* cmd);
@@ -0,0 +1,119 @@
+/*
+ * trace.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef TRACE_HPP90215
+#define TRACE_HPP90215
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+
+// A trace is every call MQ2 made into the plugin during a session, plus the answers MQ2 gave to data
+// queries, so luna_host can play the session back against Luna. The file is "LTRC", a version byte, then
+// records of a kind byte, the microseconds since the previous record as a varint, and the kind's payload:
+//   GameState     varint state
+//   Chat          varint color, string
+//   LunaCommand   string, the text after /luna
+//   BindCommand   string, the text after /ldo
+//   Data          string expression, answer kind byte, then a zigzag varint, 8 byte double or string
+// Strings are a varint length followed by the bytes. The other kinds have no payload.
+enum class TraceKind : std::uint8_t {
+  Pulse = 1,
+  DrawHUD,
+  Zoned,
+  BeginZone,
+  EndZone,
+  CleanUI,
+  ReloadUI,
+  GameState,
+  Chat,
+  LunaCommand,
+  BindCommand,
+  Data,
+  Count,
+};
+
+const char* trace_kind_name(TraceKind kind);
+
+// what ParseMQ2DataPortion answered, in terms of the MQ2 type luna converts it by.
+struct TraceAnswer {
+  // None is a failed parse, Other is any type luna reads as a boolean DWORD.
+  enum class Kind : std::uint8_t { None, Int, Int64, Float, Double, String, Other };
+
+  Kind kind = Kind::None;
+  std::int64_t integer = 0;
+  double number = 0;
+  std::string string;
+};
+
+struct TraceRecord {
+  TraceKind kind;
+  // since the start of the trace.
+  std::chrono::microseconds time;
+  // the color of a chat line, or the game state.
+  std::uint32_t value;
+  // the chat line, command or data expression.
+  std::string text;
+  TraceAnswer answer;
+};
+
+class TraceRecorder {
+public:
+  ~TraceRecorder();
+
+  bool start(const std::filesystem::path& path);
+  void stop();
+  inline bool recording() const { return recording_; }
+
+  // for the kinds without a payload.
+  void hook(TraceKind kind);
+  void game_state(std::uint32_t state);
+  void chat(std::string_view line, std::uint32_t color);
+  // kind is LunaCommand or BindCommand.
+  void command(TraceKind kind, std::string_view line);
+  void data(std::string_view expr, const TraceAnswer& answer);
+
+  std::uint64_t records = 0;
+  std::uint64_t bytes = 0;
+
+private:
+  void begin(TraceKind kind);
+  void put_varint(std::uint64_t v);
+  void put_string(std::string_view sv);
+  void flush_if_full();
+  void flush();
+
+  bool recording_ = false;
+  std::ofstream out_;
+  // written out in large pieces, records are a few bytes each.
+  std::string buf_;
+  std::chrono::steady_clock::time_point start_;
+  std::int64_t last_us_ = 0;
+};
+
+class TraceReader {
+public:
+  bool open(const std::filesystem::path& path);
+  // false at the end of the trace, or at a record that's cut short.
+  bool next(TraceRecord& out);
+
+private:
+  bool get_varint(std::uint64_t& v);
+  bool get_string(std::string& out);
+
+  std::ifstream in_;
+  std::int64_t time_us_ = 0;
+};
+
+namespace zx {
+// fed by the plugin entry points while /luna record is on.
+extern TraceRecorder trace_recorder;
+} // namespace zx
+
+#endif /* !TRACE_HPP90215 */
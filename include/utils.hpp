@@ -9,6 +9,7 @@
 
 #include "lua.hpp"
 #include "luna_defs.hpp"
+#include <chrono>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -18,6 +19,14 @@ class LunaContext;
 namespace zx {
 std::vector<std::string_view> strsplit(std::string_view str, std::string_view delims = " ");
 LunaContext* get_context(lua_State* ls);
+
+// what modules are scheduled by: steady_clock in the game, luna_host sets clock_override to its simulated
+// clock so modules that sleep don't hold up a run. Timing of work itself always uses steady_clock.
+using Clock = std::chrono::steady_clock::time_point (*)();
+extern Clock clock_override;
+inline std::chrono::steady_clock::time_point now() {
+  return clock_override != nullptr ? clock_override() : std::chrono::steady_clock::now();
+}
 } // namespace zx
 
 #endif /* !UTILS_HPP80518 */
@@ -0,0 +1,25 @@
+/*
+ * value_codec.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef VALUE_CODEC_HPP20467
+#define VALUE_CODEC_HPP20467
+
+#include <string>
+#include <string_view>
+
+#include "lua.hpp"
+
+// Copies plain Lua values between states as bytes: nil, booleans, numbers, strings and tables of
+// those. Functions, userdata, threads, metatables and shared or cyclic table references don't survive
+// the trip, anything that can't be encoded is an error.
+namespace zx {
+// appends the n values starting at idx to out, on failure error says why.
+bool encode_values(lua_State* ls, int idx, int n, std::string& out, std::string& error);
+// pushes the values encoded in data and returns how many, or -1 if data is malformed.
+int decode_values(lua_State* ls, std::string_view data);
+} // namespace zx
+
+#endif /* !VALUE_CODEC_HPP20467 */
@@ -0,0 +1,31 @@
+/*
+ * win32_compat.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef WIN32_COMPAT_HPP52117
+#define WIN32_COMPAT_HPP52117
+
+// Just enough of windows.h for the MQ2 declarations to compile elsewhere, for luna_host. The sizes match
+// the 32 bit windows ones so the structs keep their layout.
+
+#include <cstdint>
+
+using BYTE = std::uint8_t;
+using UCHAR = unsigned char;
+using DWORD = std::uint32_t;
+using LONG = std::int32_t;
+using BOOL = int;
+using FLOAT = float;
+using DOUBLE = double;
+using PVOID = void*;
+using PCHAR = char*;
+
+#define VOID void
+#define __int64 long long
+#define __cdecl
+#define __declspec(x)
+#define MAX_PATH 260
+
+#endif /* !WIN32_COMPAT_HPP52117 */
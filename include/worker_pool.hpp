@@ -0,0 +1,100 @@
+/*
+ * worker_pool.hpp Copyright © 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#ifndef WORKER_POOL_HPP71934
+#define WORKER_POOL_HPP71934
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bytecode_cache.hpp"
+#include "lua.hpp"
+#include "luna_alloc.hpp"
+
+// Runs luna.async jobs on a fixed set of threads, each with its own sandboxed lua_State: base, string,
+// table, math, utf8, coroutine and a read-only slice of os, no io, package, debug or luna table. Each job
+// runs in a fresh copy of those globals, so nothing it changes is seen by the next one. Jobs and
+// their results only carry bytes (chunks and zx::encode_values output), nothing is shared with the
+// game thread. Finished jobs are collected with drain, which is the game thread's side of it.
+// The same threads also compile modules ahead of /luna run, see BytecodeCache::precompile.
+class WorkerPool {
+public:
+  enum class Kind : std::uint8_t { Run, Compile };
+
+  struct Job {
+    Kind kind;
+    // the context is referred to by id, it may be gone by the time the job is done. 0 for Compile.
+    std::uint32_t ctx_id;
+    std::uint64_t job_id;
+    // lua source, or a lua_dump'd function when binary is set. For Compile, the file to compile.
+    std::string chunk;
+    bool binary;
+    // for Compile, the package.path its requires are looked up in.
+    std::string args;
+    const BytecodeCache* cache;
+  };
+
+  struct Result {
+    Kind kind;
+    std::uint32_t ctx_id;
+    std::uint64_t job_id;
+    bool ok;
+    // the encoded return values, or the error message.
+    std::string payload;
+    std::vector<CompiledChunk> chunks;
+  };
+
+  WorkerPool() = default;
+  ~WorkerPool();
+  WorkerPool(const WorkerPool& other) = delete;
+  WorkerPool& operator=(const WorkerPool& other) = delete;
+
+  // takes effect when the threads are started, which happens on the first submit.
+  void configure(std::size_t threads, std::size_t memory_limit);
+  inline bool enabled() const { return thread_count_ > 0; }
+  std::uint64_t submit(std::uint32_t ctx_id, std::string chunk, bool binary, std::string args);
+  std::uint64_t submit_compile(const BytecodeCache& cache, std::string path, std::string search_path);
+  // moves the finished jobs into out.
+  void drain(std::vector<Result>& out);
+  inline std::size_t pending() const { return pending_; }
+
+private:
+  struct Worker {
+    std::unique_ptr<LunaAllocator> allocator;
+    lua_State* ls = nullptr;
+    std::thread thread;
+  };
+
+  static void stop_hook(lua_State* ls, lua_Debug* ar);
+  void start();
+  void run(Worker& worker);
+  void push_job(Job job);
+  Result execute(Worker& worker, Job& job);
+  static Result compile(Job& job);
+
+  std::size_t thread_count_ = 0;
+  std::size_t memory_limit_ = 0;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::uint64_t last_job_id_ = 0;
+  // jobs submitted whose results haven't been drained yet, game thread only.
+  std::size_t pending_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::deque<Job> jobs_;
+  std::vector<Result> results_;
+  std::atomic<bool> stopping_ = false;
+};
+
+#endif /* !WORKER_POOL_HPP71934 */
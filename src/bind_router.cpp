@@ -0,0 +1,106 @@
+/*
+ * bind_router.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#include "bind_router.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+constexpr std::size_t min_capacity = 32;
+
+std::uint64_t fnv1a(std::string_view sv) {
+  std::uint64_t h = 14695981039346656037ull;
+  for (char c : sv) {
+    h ^= static_cast<unsigned char>(c);
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+} // namespace
+
+std::size_t BindRouter::probe(std::string_view command, std::uint64_t hash) const {
+  auto mask = slots_.size() - 1;
+  for (auto i = hash & mask;; i = (i + 1) & mask) {
+    const Slot& slot = slots_[i];
+    if (slot.state == State::Empty) {
+      return i;
+    }
+    if (slot.state == State::Full && slot.hash == hash && slot.command == command) {
+      return i;
+    }
+  }
+}
+
+bool BindRouter::add(std::string_view command, LunaContext* ctx, int fn_key) {
+  if ((used_ + 1) * 2 > slots_.size()) {
+    // only grow if it's actually full of live entries, otherwise just sweep out the removed ones.
+    rehash(size_ * 4 > slots_.size() ? slots_.size() * 2 : std::max(slots_.size(), min_capacity));
+  }
+  auto hash = fnv1a(command);
+  Slot& slot = slots_[probe(command, hash)];
+  if (slot.state == State::Full) {
+    return false;
+  }
+  slot.command.assign(command);
+  slot.hash = hash;
+  slot.route = {ctx, fn_key};
+  slot.state = State::Full;
+  ++size_;
+  ++used_;
+  return true;
+}
+
+const BindRouter::Route* BindRouter::find(std::string_view command) const {
+  if (size_ == 0) {
+    return nullptr;
+  }
+  const Slot& slot = slots_[probe(command, fnv1a(command))];
+  return slot.state == State::Full ? &slot.route : nullptr;
+}
+
+void BindRouter::remove_context(const LunaContext* ctx) {
+  for (Slot& slot : slots_) {
+    if (slot.state == State::Full && slot.route.ctx == ctx) {
+      slot.state = State::Removed;
+      slot.command.clear();
+      --size_;
+    }
+  }
+}
+
+void BindRouter::clear() {
+  slots_.clear();
+  size_ = 0;
+  used_ = 0;
+}
+
+void BindRouter::rehash(std::size_t capacity) {
+  std::vector<Slot> old = std::exchange(slots_, std::vector<Slot>(capacity));
+  used_ = size_;
+  auto mask = capacity - 1;
+  for (Slot& slot : old) {
+    if (slot.state != State::Full) {
+      continue;
+    }
+    auto i = slot.hash & mask;
+    while (slots_[i].state != State::Empty) {
+      i = (i + 1) & mask;
+    }
+    slots_[i] = std::move(slot);
+  }
+}
+
+void CommandArena::push(std::string_view command) {
+  spans_.push_back({std::uint32_t(text_.size()), std::uint32_t(command.size())});
+  text_.append(command);
+}
+
+void CommandArena::clear() {
+  text_.clear();
+  spans_.clear();
+}
@@ -0,0 +1,304 @@
+/*
+ * bytecode_cache.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#include "bytecode_cache.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string_view>
+#include <unordered_set>
+
+namespace fs = std::filesystem;
+
+namespace {
+constexpr char cache_magic[4] = {'L', 'U', 'N', 'C'};
+// a module pulling in more than this is compiled the rest of the way by require.
+constexpr std::size_t max_precompiled = 256;
+
+// precompile runs on several threads at once, each write gets its own temporary file.
+std::atomic<std::uint32_t> tmp_counter = 0;
+
+int append_chunk(lua_State*, const void* p, size_t sz, void* ud) {
+  static_cast<std::string*>(ud)->append(static_cast<const char*>(p), sz);
+  return 0;
+}
+
+std::uint64_t fnv1a(std::string_view sv) {
+  std::uint64_t h = 14695981039346656037ull;
+  for (char c : sv) {
+    h ^= static_cast<unsigned char>(c);
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+bool is_name_char(char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; }
+
+// the names in require "name", require 'name' and require("name") calls. Only meant to find what a module
+// loads up front, anything it misses (or finds in a comment) is harmless.
+void find_requires(std::string_view src, std::vector<std::string>& out) {
+  constexpr std::string_view keyword = "require";
+  for (auto pos = src.find(keyword); pos != std::string_view::npos; pos = src.find(keyword, pos + 1)) {
+    auto i = pos + keyword.size();
+    if ((pos > 0 && is_name_char(src[pos - 1])) || (i < src.size() && is_name_char(src[i]))) {
+      continue;
+    }
+    i = std::min(src.find_first_not_of(" \t", i), src.size());
+    if (i < src.size() && src[i] == '(') {
+      i = std::min(src.find_first_not_of(" \t", i + 1), src.size());
+    }
+    if (i >= src.size() || (src[i] != '"' && src[i] != '\'')) {
+      continue;
+    }
+    auto end = src.find(src[i], i + 1);
+    if (end == std::string_view::npos) {
+      continue;
+    }
+    auto name = src.substr(i + 1, end - i - 1);
+    if (!name.empty() && name.find_first_of("\\\n") == std::string_view::npos) {
+      out.emplace_back(name);
+    }
+  }
+}
+
+// package.searchpath, without a lua_State.
+fs::path search_path_for(std::string_view name, std::string_view search_path) {
+  std::string file_name{name};
+  std::replace(file_name.begin(), file_name.end(), '.', '/');
+  std::string candidate;
+  while (!search_path.empty()) {
+    auto end = std::min(search_path.find(';'), search_path.size());
+    auto pattern = search_path.substr(0, end);
+    search_path.remove_prefix(std::min(end + 1, search_path.size()));
+    if (pattern.empty()) {
+      continue;
+    }
+    candidate.clear();
+    for (char c : pattern) {
+      if (c == '?') {
+        candidate += file_name;
+      } else {
+        candidate += c;
+      }
+    }
+    std::error_code ec;
+    if (fs::is_regular_file(candidate, ec)) {
+      return candidate;
+    }
+  }
+  return {};
+}
+} // namespace
+
+BytecodeCache::Header BytecodeCache::header_for(std::int64_t mtime, std::uint64_t size) {
+  Header header;
+  std::memcpy(header.magic, cache_magic, sizeof(header.magic));
+  header.lua_version = LUA_VERSION_NUM;
+  header.mtime = mtime;
+  header.size = size;
+  return header;
+}
+
+fs::path BytecodeCache::entry_path(const fs::path& source) const {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx.luac", (unsigned long long)fnv1a(source.generic_string()));
+  return dir_ / name;
+}
+
+bool BytecodeCache::read_entry(const fs::path& entry, const Header& expected, std::string& code) const {
+  std::error_code ec;
+  auto size = fs::file_size(entry, ec);
+  if (ec || size < sizeof(Header)) {
+    return false;
+  }
+  std::ifstream in{entry, std::ios::binary};
+  Header header;
+  if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+    return false;
+  }
+  if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+      header.lua_version != expected.lua_version || header.mtime != expected.mtime || header.size != expected.size) {
+    return false;
+  }
+  code.resize(size - sizeof(Header));
+  return bool(in.read(code.data(), code.size()));
+}
+
+void BytecodeCache::write_entry(const fs::path& entry, const Header& header, const std::string& code) const {
+  std::error_code ec;
+  fs::create_directories(dir_, ec);
+  // write then rename, so a half written entry is never picked up.
+  auto tmp = entry;
+  tmp += "." + std::to_string(++tmp_counter) + ".tmp";
+  {
+    std::ofstream out{tmp, std::ios::binary | std::ios::trunc};
+    if (!out) {
+      return;
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(code.data(), code.size());
+    if (!out) {
+      return;
+    }
+  }
+  fs::remove(entry, ec);
+  fs::rename(tmp, entry, ec);
+}
+
+int BytecodeCache::load_file(lua_State* ls, const fs::path& path) {
+  auto path_str = path.generic_string();
+  std::error_code ec;
+  auto mtime = fs::last_write_time(path, ec);
+  auto size = ec ? 0 : fs::file_size(path, ec);
+  if (ec || dir_.empty()) {
+    // let lua produce the usual error message (or just load it, without a cache dir).
+    return luaL_loadfilex(ls, path_str.c_str(), nullptr);
+  }
+  Header header = header_for(mtime.time_since_epoch().count(), size);
+
+  std::string chunkname = "@" + path_str;
+  auto preloaded = preloaded_.find(path_str);
+  if (preloaded != preloaded_.end() && preloaded->second.mtime == header.mtime && preloaded->second.size == size) {
+    const std::string& code = preloaded->second.code;
+    if (luaL_loadbufferx(ls, code.data(), code.size(), chunkname.c_str(), "b") == LUA_OK) {
+      ++hits;
+      return LUA_OK;
+    }
+    lua_pop(ls, 1);
+  }
+  auto entry = entry_path(path);
+  if (read_entry(entry, header, buf_)) {
+    if (luaL_loadbufferx(ls, buf_.data(), buf_.size(), chunkname.c_str(), "b") == LUA_OK) {
+      ++hits;
+      return LUA_OK;
+    }
+    // corrupt entry, drop the error message and recompile over it.
+    lua_pop(ls, 1);
+  }
+  ++misses;
+  auto status = luaL_loadfilex(ls, path_str.c_str(), nullptr);
+  if (status != LUA_OK) {
+    return status;
+  }
+  std::string code;
+  if (lua_dump(ls, append_chunk, &code, 0) == 0) {
+    write_entry(entry, header, code);
+  }
+  return LUA_OK;
+}
+
+bool BytecodeCache::compile_file(lua_State* ls, const fs::path& path, CompiledChunk& out, std::string& source) const {
+  out.path = path.generic_string();
+  std::error_code ec;
+  auto mtime = fs::last_write_time(path, ec);
+  out.size = ec ? 0 : fs::file_size(path, ec);
+  if (ec) {
+    return false;
+  }
+  out.mtime = mtime.time_since_epoch().count();
+  {
+    std::ifstream in{path, std::ios::binary};
+    source.resize(out.size);
+    if (!in.read(source.data(), source.size())) {
+      return false;
+    }
+  }
+  Header header = header_for(out.mtime, out.size);
+  auto entry = entry_path(path);
+  if (!dir_.empty() && read_entry(entry, header, out.code)) {
+    return true;
+  }
+  // loadfile rather than loadbuffer, it skips a leading # line the same way load_file does.
+  if (luaL_loadfilex(ls, out.path.c_str(), nullptr) != LUA_OK) {
+    lua_pop(ls, 1);
+    return false;
+  }
+  out.code.clear();
+  bool dumped = lua_dump(ls, append_chunk, &out.code, 0) == 0;
+  lua_pop(ls, 1);
+  if (dumped && !dir_.empty()) {
+    write_entry(entry, header, out.code);
+  }
+  return dumped;
+}
+
+void BytecodeCache::precompile(const fs::path& path, std::string_view search_path,
+                               std::vector<CompiledChunk>& out) const {
+  lua_State* ls = luaL_newstate();
+  if (ls == nullptr) {
+    return;
+  }
+  std::vector<fs::path> todo{path};
+  std::unordered_set<std::string> seen{path.generic_string()};
+  std::vector<std::string> names;
+  std::string source;
+  while (!todo.empty() && out.size() < max_precompiled) {
+    fs::path file = std::move(todo.back());
+    todo.pop_back();
+    CompiledChunk chunk;
+    if (!compile_file(ls, file, chunk, source)) {
+      continue;
+    }
+    names.clear();
+    find_requires(source, names);
+    for (const std::string& name : names) {
+      auto found = search_path_for(name, search_path);
+      if (!found.empty() && seen.insert(found.generic_string()).second) {
+        todo.push_back(std::move(found));
+      }
+    }
+    out.push_back(std::move(chunk));
+  }
+  lua_close(ls);
+}
+
+void BytecodeCache::preload(std::vector<CompiledChunk>& chunks) {
+  for (CompiledChunk& chunk : chunks) {
+    auto path = chunk.path;
+    preloaded_.insert_or_assign(std::move(path), std::move(chunk));
+  }
+  chunks.clear();
+}
+
+int BytecodeCache::searcher(lua_State* ls) {
+  auto cache = static_cast<BytecodeCache*>(lua_touserdata(ls, lua_upvalueindex(1)));
+  const char* name = luaL_checkstring(ls, 1);
+  lua_getglobal(ls, "package");
+  lua_getfield(ls, -1, "searchpath");
+  lua_pushstring(ls, name);
+  lua_getfield(ls, -3, "path");
+  lua_call(ls, 2, 1);
+  if (!lua_isstring(ls, -1)) {
+    // not found, the stock searcher right after this one reports where it looked.
+    return 0;
+  }
+  std::string filename = lua_tostring(ls, -1);
+  if (cache->load_file(ls, filename) != LUA_OK) {
+    return luaL_error(ls, "error loading module '%s' from file '%s':\n\t%s", name, filename.c_str(),
+                      lua_tostring(ls, -1));
+  }
+  lua_pushstring(ls, filename.c_str());
+  return 2;
+}
+
+void BytecodeCache::install_searcher(lua_State* ls) {
+  lua_getglobal(ls, "package");
+  lua_getfield(ls, -1, "searchers");
+  // shift everything from the lua file searcher (2) up by one.
+  for (auto i = luaL_len(ls, -1); i >= 2; --i) {
+    lua_rawgeti(ls, -1, i);
+    lua_rawseti(ls, -2, i + 1);
+  }
+  lua_pushlightuserdata(ls, this);
+  lua_pushcclosure(ls, searcher, 1);
+  lua_rawseti(ls, -2, 2);
+  lua_pop(ls, 2);
+}
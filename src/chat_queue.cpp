@@ -0,0 +1,99 @@
+/*
+ * chat_queue.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#include "chat_queue.hpp"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+namespace zx {
+ChatQueue chat_queue;
+} // namespace zx
+
+namespace {
+// MQ2 copies chat lines into buffers of this size.
+constexpr std::size_t max_line = 4095;
+// room reserved up front for a formatted line, longer ones are formatted a second time.
+constexpr std::size_t line_hint = 256;
+} // namespace
+
+void ChatQueue::format(const char* fmt, ...) {
+  auto start = text_.size();
+  text_.resize(start + line_hint);
+  va_list args;
+  va_start(args, fmt);
+  va_list retry;
+  va_copy(retry, args);
+  int n = std::vsnprintf(text_.data() + start, line_hint, fmt, args);
+  if (n >= 0 && std::size_t(n) >= line_hint) {
+    auto length = std::min(std::size_t(n), max_line);
+    text_.resize(start + length + 1);
+    n = std::vsnprintf(text_.data() + start, length + 1, fmt, retry);
+  }
+  va_end(retry);
+  va_end(args);
+  if (n < 0) {
+    text_.resize(start);
+    return;
+  }
+  auto length = std::min(std::size_t(n), max_line);
+  text_.resize(start + length + 1);
+  commit(start, length);
+}
+
+void ChatQueue::push(std::string_view line) {
+  auto start = text_.size();
+  auto length = std::min(line.size(), max_line);
+  text_.append(line.data(), length);
+  text_.push_back('\0');
+  commit(start, length);
+}
+
+void ChatQueue::commit(std::size_t start, std::size_t length) {
+  if (!lines_.empty()) {
+    Line& last = lines_.back();
+    if (last.length == length && std::memcmp(text_.data() + last.offset, text_.data() + start, length) == 0) {
+      ++last.repeats;
+      ++merged;
+      text_.resize(start);
+      return;
+    }
+  }
+  lines_.push_back({.offset = std::uint32_t(start), .length = std::uint32_t(length), .repeats = 1});
+}
+
+void ChatQueue::flush(std::size_t budget, Writer write) {
+  std::size_t count = 0;
+  std::uint64_t dropped_now = 0;
+  for (const Line& line : lines_) {
+    if (budget != 0 && count == budget) {
+      dropped_now += line.repeats;
+      continue;
+    }
+    ++count;
+    char* text = text_.data() + line.offset;
+    if (line.repeats == 1) {
+      write(text);
+      continue;
+    }
+    scratch_.assign(text, line.length);
+    scratch_ += " (x";
+    scratch_ += std::to_string(line.repeats);
+    scratch_ += ')';
+    write(scratch_.data());
+  }
+  written += count;
+  dropped += dropped_now;
+  lines_.clear();
+  text_.clear();
+  if (dropped_now != 0) {
+    scratch_ = "\ag[Luna]\ax \ar" + std::to_string(dropped_now) + " chat lines dropped this frame.\ax";
+    write(scratch_.data());
+  }
+}
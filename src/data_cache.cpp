@@ -0,0 +1,69 @@
+/*
+ * data_cache.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#include "data_cache.hpp"
+
+namespace {
+// expressions built on the fly (with ids or names baked in) would otherwise pile up forever.
+constexpr std::size_t max_entries = 4096;
+} // namespace
+
+void DataValue::push(lua_State* ls) const {
+  switch (kind) {
+  case Kind::Nil:
+    lua_pushnil(ls);
+    break;
+  case Kind::Integer:
+    lua_pushinteger(ls, integer);
+    break;
+  case Kind::Number:
+    lua_pushnumber(ls, number);
+    break;
+  case Kind::String:
+    lua_pushlstring(ls, string.data(), string.size());
+    break;
+  case Kind::Boolean:
+    lua_pushboolean(ls, boolean);
+    break;
+  }
+}
+
+const DataValue* DataCache::find(std::string_view expr) {
+  auto it = entries_.find(expr);
+  if (it == entries_.end() || it->second.generation != generation_) {
+    ++misses;
+    return nullptr;
+  }
+  ++hits;
+  return &it->second.value;
+}
+
+DataValue& DataCache::store(std::string_view expr) {
+  auto it = entries_.find(expr);
+  if (it == entries_.end()) {
+    it = entries_.emplace(std::string{expr}, Entry{}).first;
+  }
+  it->second.generation = generation_;
+  return it->second.value;
+}
+
+void DataCache::invalidate() {
+  ++generation_;
+  if (entries_.size() > max_entries) {
+    entries_.clear();
+  }
+}
+
+bool DataCache::fresh(std::uint64_t& stamp) {
+  if (stamp == generation_) {
+    ++hits;
+    return true;
+  }
+  ++misses;
+  stamp = generation_;
+  return false;
+}
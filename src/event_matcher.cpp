@@ -0,0 +1,909 @@
+/*
+ * event_matcher.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#include "event_matcher.hpp"
+
+#include <algorithm>
+#include <cctype>
+
+namespace {
+// once the lazy DFA grows past this many states the cache is thrown away and rebuilt on demand.
+constexpr std::size_t max_dfa_states = 2048;
+// counted repetitions are expanded into copies, anything larger goes to std::regex instead.
+constexpr int max_repeat = 32;
+
+struct Node {
+  enum class Kind : std::uint8_t { Empty, Set, Cat, Alt, Repeat };
+  Kind kind;
+  std::bitset<256> set;
+  std::vector<int> kids;
+  int min = 0;
+  // -1 is unbounded
+  int max = 0;
+};
+
+// Parses the subset of ECMAScript regex syntax used by event strings. Anything outside that subset
+// (or anything malformed) makes parse() return -1 and the pattern is left to std::regex.
+class Parser {
+public:
+  explicit Parser(std::string_view src) : src_{src} {}
+
+  int parse() {
+    int root = parse_alt();
+    if (!ok_ || pos_ != src_.size()) {
+      return -1;
+    }
+    return root;
+  }
+
+  std::vector<Node> nodes;
+
+private:
+  int add_node(Node::Kind kind) {
+    nodes.emplace_back().kind = kind;
+    return nodes.size() - 1;
+  }
+
+  int add_set(const std::bitset<256>& set) {
+    int idx = add_node(Node::Kind::Set);
+    nodes[idx].set = set;
+    return idx;
+  }
+
+  int add_list(Node::Kind kind, std::vector<int> kids) {
+    int idx = add_node(kind);
+    nodes[idx].kids = std::move(kids);
+    return idx;
+  }
+
+  int add_repeat(int atom, int min, int max) {
+    int idx = add_list(Node::Kind::Repeat, {atom});
+    nodes[idx].min = min;
+    nodes[idx].max = max;
+    return idx;
+  }
+
+  int fail() {
+    ok_ = false;
+    return -1;
+  }
+
+  bool at_end() const { return pos_ >= src_.size(); }
+  char peek() const { return src_[pos_]; }
+
+  int parse_alt() {
+    std::vector<int> kids{parse_cat()};
+    while (ok_ && !at_end() && peek() == '|') {
+      ++pos_;
+      kids.push_back(parse_cat());
+    }
+    if (!ok_) {
+      return -1;
+    }
+    if (kids.size() == 1) {
+      return kids[0];
+    }
+    return add_list(Node::Kind::Alt, std::move(kids));
+  }
+
+  int parse_cat() {
+    std::vector<int> kids;
+    while (ok_ && !at_end() && peek() != '|' && peek() != ')') {
+      kids.push_back(parse_repeat());
+    }
+    if (!ok_) {
+      return -1;
+    }
+    if (kids.size() == 1) {
+      return kids[0];
+    }
+    return add_list(Node::Kind::Cat, std::move(kids));
+  }
+
+  bool parse_int(int& out) {
+    if (at_end() || !std::isdigit(static_cast<unsigned char>(peek()))) {
+      return false;
+    }
+    out = 0;
+    while (!at_end() && std::isdigit(static_cast<unsigned char>(peek()))) {
+      out = out * 10 + (peek() - '0');
+      if (out > max_repeat) {
+        return false;
+      }
+      ++pos_;
+    }
+    return true;
+  }
+
+  int parse_repeat() {
+    int atom = parse_atom();
+    if (!ok_ || at_end()) {
+      return atom;
+    }
+    int min = 0;
+    int max = 0;
+    switch (peek()) {
+    case '*':
+      min = 0;
+      max = -1;
+      ++pos_;
+      break;
+    case '+':
+      min = 1;
+      max = -1;
+      ++pos_;
+      break;
+    case '?':
+      min = 0;
+      max = 1;
+      ++pos_;
+      break;
+    case '{':
+      ++pos_;
+      if (!parse_int(min)) {
+        return fail();
+      }
+      max = min;
+      if (!at_end() && peek() == ',') {
+        ++pos_;
+        max = -1;
+        if (!at_end() && peek() != '}' && !parse_int(max)) {
+          return fail();
+        }
+      }
+      if (at_end() || peek() != '}' || (max != -1 && max < min)) {
+        return fail();
+      }
+      ++pos_;
+      break;
+    default:
+      return atom;
+    }
+    // lazy quantifiers match the same set of lines as greedy ones.
+    if (!at_end() && peek() == '?') {
+      ++pos_;
+    }
+    return add_repeat(atom, min, max);
+  }
+
+  static std::bitset<256> range(unsigned char lo, unsigned char hi) {
+    std::bitset<256> set;
+    for (int c = lo; c <= hi; ++c) {
+      set.set(c);
+    }
+    return set;
+  }
+
+  static std::bitset<256> word_chars() { return range('a', 'z') | range('A', 'Z') | range('0', '9') | range('_', '_'); }
+
+  static std::bitset<256> space_chars() { return range('\t', '\r') | range(' ', ' '); }
+
+  static bool is_hex(char c) { return std::isxdigit(static_cast<unsigned char>(c)); }
+
+  static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+      return c - '0';
+    }
+    return (std::tolower(static_cast<unsigned char>(c)) - 'a') + 10;
+  }
+
+  // parses the escape after a backslash. single is set to the character for single character escapes
+  // and to -1 for class escapes like \d.
+  bool parse_escape(std::bitset<256>& set, int& single) {
+    if (at_end()) {
+      return false;
+    }
+    char c = src_[pos_++];
+    single = -1;
+    switch (c) {
+    case 'd':
+      set = range('0', '9');
+      return true;
+    case 'D':
+      set = ~range('0', '9');
+      return true;
+    case 'w':
+      set = word_chars();
+      return true;
+    case 'W':
+      set = ~word_chars();
+      return true;
+    case 's':
+      set = space_chars();
+      return true;
+    case 'S':
+      set = ~space_chars();
+      return true;
+    case 't':
+      single = '\t';
+      break;
+    case 'n':
+      single = '\n';
+      break;
+    case 'r':
+      single = '\r';
+      break;
+    case 'f':
+      single = '\f';
+      break;
+    case 'v':
+      single = '\v';
+      break;
+    case '0':
+      if (!at_end() && std::isdigit(static_cast<unsigned char>(peek()))) {
+        return false;
+      }
+      single = '\0';
+      break;
+    case 'x':
+      if (pos_ + 1 >= src_.size() || !is_hex(src_[pos_]) || !is_hex(src_[pos_ + 1])) {
+        return false;
+      }
+      single = hex_value(src_[pos_]) * 16 + hex_value(src_[pos_ + 1]);
+      pos_ += 2;
+      break;
+    case 'c':
+      if (at_end() || !std::isalpha(static_cast<unsigned char>(peek()))) {
+        return false;
+      }
+      single = src_[pos_++] % 32;
+      break;
+    default:
+      // backreferences, \b, \B, \u and friends are left to std::regex.
+      if (std::isalnum(static_cast<unsigned char>(c))) {
+        return false;
+      }
+      single = static_cast<unsigned char>(c);
+      break;
+    }
+    set.reset();
+    set.set(single);
+    return true;
+  }
+
+  bool parse_class_item(std::bitset<256>& set, int& single) {
+    if (at_end()) {
+      return false;
+    }
+    char c = src_[pos_];
+    if (c == '\\') {
+      ++pos_;
+      return parse_escape(set, single);
+    }
+    // [[ could start a posix class like [[:alpha:]], which libstdc++ accepts even in ECMAScript mode.
+    if (c == '[') {
+      return false;
+    }
+    ++pos_;
+    single = static_cast<unsigned char>(c);
+    set.reset();
+    set.set(single);
+    return true;
+  }
+
+  int parse_class() {
+    std::bitset<256> set;
+    bool negate = false;
+    if (!at_end() && peek() == '^') {
+      negate = true;
+      ++pos_;
+    }
+    if (!at_end() && peek() == ']') {
+      return fail();
+    }
+    while (!at_end() && peek() != ']') {
+      std::bitset<256> item;
+      int lo = -1;
+      if (!parse_class_item(item, lo)) {
+        return fail();
+      }
+      if (lo != -1 && pos_ + 1 < src_.size() && peek() == '-' && src_[pos_ + 1] != ']') {
+        ++pos_;
+        int hi = -1;
+        if (!parse_class_item(item, hi) || hi == -1 || hi < lo || lo >= 0x80 || hi >= 0x80) {
+          return fail();
+        }
+        item = range(lo, hi);
+      }
+      set |= item;
+    }
+    if (at_end()) {
+      return fail();
+    }
+    ++pos_;
+    if (negate) {
+      set.flip();
+    }
+    return add_set(set);
+  }
+
+  int parse_atom() {
+    char c = peek();
+    switch (c) {
+    case '(': {
+      ++pos_;
+      if (src_.substr(pos_).starts_with("?:")) {
+        pos_ += 2;
+      } else if (!at_end() && peek() == '?') {
+        return fail();
+      }
+      int inner = parse_alt();
+      if (!ok_ || at_end() || peek() != ')') {
+        return fail();
+      }
+      ++pos_;
+      return inner;
+    }
+    case '^':
+      // event strings are always matched against the whole line, so anchors are only meaningful
+      // at the very ends of the pattern.
+      if (pos_ != 0) {
+        return fail();
+      }
+      ++pos_;
+      return add_node(Node::Kind::Empty);
+    case '$':
+      if (pos_ != src_.size() - 1) {
+        return fail();
+      }
+      ++pos_;
+      return add_node(Node::Kind::Empty);
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+      return fail();
+    case '.': {
+      std::bitset<256> set;
+      set.set();
+      set.reset('\n');
+      set.reset('\r');
+      ++pos_;
+      return add_set(set);
+    }
+    case '[':
+      ++pos_;
+      return parse_class();
+    case '\\': {
+      ++pos_;
+      std::bitset<256> set;
+      int single = -1;
+      if (!parse_escape(set, single)) {
+        return fail();
+      }
+      return add_set(set);
+    }
+    default: {
+      ++pos_;
+      std::bitset<256> set;
+      set.set(static_cast<unsigned char>(c));
+      return add_set(set);
+    }
+    }
+  }
+
+  std::string_view src_;
+  std::size_t pos_ = 0;
+  bool ok_ = true;
+};
+
+// the longest string every match of the node has to contain.
+std::string required_literal(const std::vector<Node>& nodes, int idx) {
+  const Node& node = nodes[idx];
+  switch (node.kind) {
+  case Node::Kind::Set:
+    if (node.set.count() == 1) {
+      for (int c = 0; c < 256; ++c) {
+        if (node.set.test(c)) {
+          return std::string(1, char(c));
+        }
+      }
+    }
+    return {};
+  case Node::Kind::Cat: {
+    std::string best;
+    std::string run;
+    for (int kid : node.kids) {
+      const Node& k = nodes[kid];
+      if (k.kind == Node::Kind::Set && k.set.count() == 1) {
+        run += required_literal(nodes, kid);
+        continue;
+      }
+      if (run.size() > best.size()) {
+        best = run;
+      }
+      run.clear();
+      auto inner = required_literal(nodes, kid);
+      if (inner.size() > best.size()) {
+        best = std::move(inner);
+      }
+    }
+    return run.size() > best.size() ? run : best;
+  }
+  case Node::Kind::Repeat:
+    if (node.min >= 1) {
+      return required_literal(nodes, node.kids[0]);
+    }
+    return {};
+  case Node::Kind::Empty:
+  case Node::Kind::Alt:
+    return {};
+  }
+  return {};
+}
+
+// conservative literal extraction straight from the source, for patterns the parser gave up on.
+std::string scan_required_literal(std::string_view src) {
+  if (src.find('|') != std::string_view::npos) {
+    return {};
+  }
+  std::string best;
+  std::string run;
+  bool last_literal = false;
+  auto end_run = [&]() {
+    if (run.size() > best.size()) {
+      best = run;
+    }
+    run.clear();
+    last_literal = false;
+  };
+  for (auto i = 0u; i < src.size(); ++i) {
+    char c = src[i];
+    switch (c) {
+    case '\\':
+      if (i + 1 < src.size() && !std::isalnum(static_cast<unsigned char>(src[i + 1]))) {
+        run += src[++i];
+        last_literal = true;
+      } else {
+        end_run();
+        if (++i >= src.size()) {
+          break;
+        }
+        // skip the escape's payload too, \x41 or \cM must not leave "41" or "M" behind as literal text.
+        std::size_t payload = 0;
+        switch (src[i]) {
+        case 'x':
+          payload = 2;
+          break;
+        case 'u':
+          payload = 4;
+          break;
+        case 'c':
+          payload = 1;
+          break;
+        default:
+          // backreferences and \0
+          if (std::isdigit(static_cast<unsigned char>(src[i]))) {
+            while (i + payload + 1 < src.size() && std::isdigit(static_cast<unsigned char>(src[i + payload + 1]))) {
+              ++payload;
+            }
+          }
+          break;
+        }
+        i += payload;
+      }
+      break;
+    case '{': {
+      // counted repeats can have a minimum of 0, and the bounds aren't literal text.
+      if (last_literal) {
+        run.pop_back();
+      }
+      end_run();
+      auto close = src.find('}', i);
+      if (close == std::string_view::npos) {
+        return {};
+      }
+      i = close;
+      break;
+    }
+    case '*':
+    case '?':
+      // the previous character is optional
+      if (last_literal) {
+        run.pop_back();
+      }
+      end_run();
+      break;
+    case '+':
+      end_run();
+      break;
+    case '[':
+    case '(': {
+      end_run();
+      // skip the whole class or group, tracking nesting and escapes.
+      int depth = 0;
+      for (; i < src.size(); ++i) {
+        if (src[i] == '\\') {
+          ++i;
+        } else if (src[i] == '(' || src[i] == '[') {
+          ++depth;
+        } else if ((src[i] == ')' || src[i] == ']') && --depth == 0) {
+          break;
+        }
+      }
+      break;
+    }
+    case '.':
+    case '^':
+    case '$':
+    case ')':
+    case ']':
+    case '}':
+      end_run();
+      break;
+    default:
+      run += c;
+      last_literal = true;
+      break;
+    }
+  }
+  end_run();
+  return best;
+}
+} // namespace
+
+int EventMatcher::add(LunaContext* ctx, int fn_key, std::string_view source) {
+  int id = patterns_.size();
+  Pattern& p = patterns_.emplace_back();
+  p.ctx = ctx;
+  p.fn_key = fn_key;
+  p.source = std::string{source};
+  p.re = std::regex{p.source};
+  p.lines_at_add = lines_scanned_;
+  p.in_automaton = compile(id);
+  if (!p.in_automaton) {
+    p.literal = scan_required_literal(p.source);
+  }
+  flush_dfa();
+  prefilter_dirty_ = true;
+  return id;
+}
+
+void EventMatcher::remove_context(const LunaContext* ctx) {
+  bool removed = false;
+  for (auto&& p : patterns_) {
+    if (p.live && p.ctx == ctx) {
+      p.live = false;
+      p.re = std::regex{};
+      ++dead_patterns_;
+      removed = true;
+    }
+  }
+  if (removed) {
+    rebuild();
+    prefilter_dirty_ = true;
+  }
+}
+
+void EventMatcher::compact() {
+  if (dead_patterns_ == 0) {
+    return;
+  }
+  std::vector<int> new_ids(patterns_.size(), -1);
+  std::deque<Pattern> live;
+  for (auto id = 0u; id < patterns_.size(); ++id) {
+    if (patterns_[id].live) {
+      new_ids[id] = int(live.size());
+      live.push_back(std::move(patterns_[id]));
+    }
+  }
+  patterns_ = std::move(live);
+  dead_patterns_ = 0;
+  // the automaton only has live patterns in it since remove_context rebuilt it, renaming them is enough.
+  for (NfaState& s : nfa_) {
+    if (s.kind == NfaState::Kind::Match) {
+      s.arg = new_ids[s.arg];
+    }
+  }
+  flush_dfa();
+  prefilter_dirty_ = true;
+}
+
+void EventMatcher::clear() {
+  patterns_.clear();
+  dead_patterns_ = 0;
+  scanner_.clear();
+  literal_patterns_.clear();
+  unfiltered_ids_.clear();
+  unfiltered_in_automaton_ = false;
+  prefilter_dirty_ = false;
+  nfa_.clear();
+  sets_.clear();
+  roots_.clear();
+  flush_dfa();
+}
+
+bool EventMatcher::compile(int id) {
+  Parser parser{patterns_[id].source};
+  int ast_root = parser.parse();
+  if (ast_root == -1) {
+    return false;
+  }
+  const std::vector<Node>& nodes = parser.nodes;
+  patterns_[id].literal = required_literal(nodes, ast_root);
+  auto emit = [this](NfaState s) {
+    nfa_.push_back(s);
+    return int(nfa_.size() - 1);
+  };
+  auto split = [&emit](int out, int out1) {
+    return emit({.kind = NfaState::Kind::Split, .out = out, .out1 = out1});
+  };
+  // compiles back to front: returns the entry state of node idx, which continues into next.
+  auto compile_node = [&](auto& self, int idx, int next) -> int {
+    const Node& node = nodes[idx];
+    switch (node.kind) {
+    case Node::Kind::Empty:
+      return next;
+    case Node::Kind::Set:
+      sets_.push_back(node.set);
+      return emit({.kind = NfaState::Kind::Set, .out = next, .arg = int(sets_.size() - 1)});
+    case Node::Kind::Cat:
+      for (auto it = node.kids.rbegin(); it != node.kids.rend(); ++it) {
+        next = self(self, *it, next);
+      }
+      return next;
+    case Node::Kind::Alt: {
+      int entry = self(self, node.kids.back(), next);
+      for (int i = int(node.kids.size()) - 2; i >= 0; --i) {
+        entry = split(self(self, node.kids[i], next), entry);
+      }
+      return entry;
+    }
+    case Node::Kind::Repeat: {
+      int tail = next;
+      if (node.max == -1) {
+        int loop = split(-1, next);
+        nfa_[loop].out = self(self, node.kids[0], loop);
+        tail = loop;
+      } else {
+        for (int i = 0; i < node.max - node.min; ++i) {
+          tail = split(self(self, node.kids[0], tail), next);
+        }
+      }
+      for (int i = 0; i < node.min; ++i) {
+        tail = self(self, node.kids[0], tail);
+      }
+      return tail;
+    }
+    }
+    return next;
+  };
+  int match = emit({.kind = NfaState::Kind::Match, .arg = id});
+  roots_.push_back(compile_node(compile_node, ast_root, match));
+  return true;
+}
+
+void EventMatcher::rebuild() {
+  nfa_.clear();
+  sets_.clear();
+  roots_.clear();
+  for (auto id = 0u; id < patterns_.size(); ++id) {
+    Pattern& p = patterns_[id];
+    if (p.live && p.in_automaton) {
+      compile(id);
+    }
+  }
+  flush_dfa();
+}
+
+void EventMatcher::rebuild_prefilter() {
+  prefilter_dirty_ = false;
+  literal_patterns_.clear();
+  unfiltered_ids_.clear();
+  unfiltered_in_automaton_ = false;
+  // patterns sharing a literal share a literal id.
+  std::map<std::string_view, int> literal_ids;
+  std::vector<std::string_view> literals;
+  for (auto id = 0u; id < patterns_.size(); ++id) {
+    const Pattern& p = patterns_[id];
+    if (!p.live) {
+      continue;
+    }
+    if (p.literal.empty()) {
+      unfiltered_ids_.push_back(id);
+      unfiltered_in_automaton_ |= p.in_automaton;
+      continue;
+    }
+    auto [it, inserted] = literal_ids.try_emplace(p.literal, literals.size());
+    if (inserted) {
+      literals.push_back(p.literal);
+      literal_patterns_.emplace_back();
+    }
+    literal_patterns_[it->second].push_back(id);
+  }
+  scanner_.build(literals);
+  if (scanner_.empty()) {
+    // too many literals to index, every pattern becomes a candidate for every line.
+    for (auto&& ids : literal_patterns_) {
+      for (int id : ids) {
+        unfiltered_ids_.push_back(id);
+        unfiltered_in_automaton_ |= patterns_[id].in_automaton;
+      }
+    }
+    std::sort(unfiltered_ids_.begin(), unfiltered_ids_.end());
+    literal_patterns_.clear();
+  }
+}
+
+EventMatcher::PatternStats EventMatcher::stats(int id) const {
+  const Pattern& p = patterns_[id];
+  std::uint64_t lines = lines_scanned_ - p.lines_at_add;
+  if (p.literal.empty() || literal_patterns_.empty()) {
+    return {.passed = lines, .rejected = 0, .matched = p.matches};
+  }
+  return {.passed = p.prefilter_passes, .rejected = lines - p.prefilter_passes, .matched = p.matches};
+}
+
+void EventMatcher::flush_dfa() {
+  dfa_.clear();
+  transitions_.clear();
+  dfa_index_.clear();
+  visit_marks_.assign(nfa_.size(), 0);
+  visit_gen_ = 0;
+  start_ = -1;
+}
+
+void EventMatcher::add_closure(int nfa_idx, std::vector<int>& out) {
+  // iterative so deeply nested patterns can't blow the stack
+  std::vector<int>& stack = closure_stack_;
+  stack.clear();
+  stack.push_back(nfa_idx);
+  while (!stack.empty()) {
+    int idx = stack.back();
+    stack.pop_back();
+    if (idx == -1 || visit_marks_[idx] == visit_gen_) {
+      continue;
+    }
+    visit_marks_[idx] = visit_gen_;
+    const NfaState& s = nfa_[idx];
+    if (s.kind == NfaState::Kind::Split) {
+      stack.push_back(s.out1);
+      stack.push_back(s.out);
+    } else {
+      out.push_back(idx);
+    }
+  }
+}
+
+void EventMatcher::next_visit_gen() {
+  if (++visit_gen_ == 0) {
+    std::fill(visit_marks_.begin(), visit_marks_.end(), 0);
+    visit_gen_ = 1;
+  }
+}
+
+int EventMatcher::dfa_state_for(std::vector<int>& nfa_set) {
+  std::sort(nfa_set.begin(), nfa_set.end());
+  auto it = dfa_index_.find(nfa_set);
+  if (it != dfa_index_.end()) {
+    return it->second;
+  }
+  DfaState state;
+  state.nfa = nfa_set;
+  for (int idx : nfa_set) {
+    if (nfa_[idx].kind == NfaState::Kind::Match) {
+      state.accepts.push_back(nfa_[idx].arg);
+    }
+  }
+  std::sort(state.accepts.begin(), state.accepts.end());
+  int dfa_idx = dfa_.size();
+  dfa_.push_back(std::move(state));
+  transitions_.resize(transitions_.size() + 256, -1);
+  dfa_index_.emplace(nfa_set, dfa_idx);
+  return dfa_idx;
+}
+
+int EventMatcher::start_state() {
+  if (start_ != -1) {
+    return start_;
+  }
+  next_visit_gen();
+  scratch_set_.clear();
+  for (int root : roots_) {
+    add_closure(root, scratch_set_);
+  }
+  start_ = dfa_state_for(scratch_set_);
+  return start_;
+}
+
+int EventMatcher::step(int dfa_idx, unsigned char c) {
+  int next = transitions_[dfa_idx * 256 + c];
+  if (next != -1) {
+    return next;
+  }
+  next_visit_gen();
+  scratch_set_.clear();
+  for (int idx : dfa_[dfa_idx].nfa) {
+    const NfaState& s = nfa_[idx];
+    if (s.kind == NfaState::Kind::Set && sets_[s.arg].test(c)) {
+      add_closure(s.out, scratch_set_);
+    }
+  }
+  if (dfa_.size() >= max_dfa_states) {
+    // the pending set lives in scratch_set_ so it survives the flush.
+    flush_dfa();
+    return dfa_state_for(scratch_set_);
+  }
+  next = dfa_state_for(scratch_set_);
+  transitions_[dfa_idx * 256 + c] = next;
+  return next;
+}
+
+void EventMatcher::match(std::string_view line, std::vector<int>& hits) {
+  hits.clear();
+  if (prefilter_dirty_) {
+    rebuild_prefilter();
+  }
+  ++lines_scanned_;
+
+  // candidates are the unfiltered patterns plus every pattern whose literal is in the line.
+  candidate_ids_.clear();
+  bool run_automaton = unfiltered_in_automaton_;
+  found_literals_.clear();
+  scanner_.scan(line, found_literals_);
+  for (int lit : found_literals_) {
+    for (int id : literal_patterns_[lit]) {
+      Pattern& p = patterns_[id];
+      ++p.prefilter_passes;
+      run_automaton |= p.in_automaton;
+      candidate_ids_.push_back(id);
+    }
+  }
+  if (candidate_ids_.empty() && unfiltered_ids_.empty()) {
+    return;
+  }
+
+  // the automaton is exact, so when it runs at all its accept set is the answer for its patterns.
+  if (run_automaton && !roots_.empty()) {
+    int state = start_state();
+    for (char c : line) {
+      state = step(state, static_cast<unsigned char>(c));
+      if (dfa_[state].nfa.empty()) {
+        break;
+      }
+    }
+    hits.insert(hits.end(), dfa_[state].accepts.begin(), dfa_[state].accepts.end());
+  }
+  auto run_fallback = [&](int id) {
+    const Pattern& p = patterns_[id];
+    if (!p.in_automaton && std::regex_match(line.begin(), line.end(), p.re)) {
+      hits.push_back(id);
+    }
+  };
+  for (int id : unfiltered_ids_) {
+    run_fallback(id);
+  }
+  for (int id : candidate_ids_) {
+    run_fallback(id);
+  }
+  std::sort(hits.begin(), hits.end());
+  for (int id : hits) {
+    ++patterns_[id].matches;
+  }
+}
+
+void EventMatcher::match(std::string_view line, EventMatches& out) {
+  out.clear();
+  match(line, hit_ids_);
+  for (int id : hit_ids_) {
+    const Pattern& p = patterns_[id];
+    EventMatches::Hit hit{.pattern_id = id, .first_capture = std::uint32_t(out.captures.size()), .capture_count = 0};
+    // the automaton only says whether a pattern matched, std::regex is only needed to find the groups.
+    if (p.re.mark_count() != 0) {
+      if (!std::regex_match(line.begin(), line.end(), capture_match_, p.re)) {
+        continue;
+      }
+      // 0 = full match string
+      for (auto l = 1u; l < capture_match_.size(); ++l) {
+        out.captures.push_back(
+            {.offset = std::uint32_t(capture_match_.position(l)), .length = std::uint32_t(capture_match_.length(l))});
+      }
+      hit.capture_count = capture_match_.size() - 1;
+    }
+    out.hits.push_back(hit);
+  }
+}
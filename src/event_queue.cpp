@@ -0,0 +1,73 @@
+/*
+ * event_queue.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#include "event_queue.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+void EventQueue::reserve(std::size_t capacity, Overflow overflow) {
+  overflow_ = overflow;
+  relayout(std::max<std::size_t>(capacity, 1));
+}
+
+void EventQueue::relayout(std::size_t capacity) {
+  auto keep = std::min(size_, capacity);
+  std::unique_ptr<char[]> arena{new char[capacity * slot_bytes]};
+  std::vector<Slot> slots(capacity);
+  for (auto i = 0u; i < keep; ++i) {
+    auto from = (head_ + size_ - keep + i) % slots_.size();
+    std::memcpy(arena.get() + i * slot_bytes, slot_text(from), slots_[from].length);
+    slots[i].length = slots_[from].length;
+    slots[i].matches = std::move(slots_[from].matches);
+  }
+  stats_.dropped += size_ - keep;
+  arena_ = std::move(arena);
+  slots_ = std::move(slots);
+  head_ = 0;
+  size_ = keep;
+}
+
+bool EventQueue::push(std::string_view line, const EventMatches& matches) {
+  if (line.size() > slot_bytes || slots_.empty()) {
+    ++stats_.dropped;
+    return false;
+  }
+  if (size_ == slots_.size()) {
+    switch (overflow_) {
+    case Overflow::DropOldest:
+      pop();
+      ++stats_.dropped;
+      break;
+    case Overflow::DropNewest:
+      ++stats_.dropped;
+      return false;
+    case Overflow::Grow:
+      relayout(slots_.size() * 2);
+      break;
+    }
+  }
+  auto i = (head_ + size_) % slots_.size();
+  std::memcpy(slot_text(i), line.data(), line.size());
+  slots_[i].length = line.size();
+  // copy assignment, so the slot's vectors are reused.
+  slots_[i].matches = matches;
+  ++size_;
+  ++stats_.enqueued;
+  stats_.high_water = std::max(stats_.high_water, size_);
+  return true;
+}
+
+std::string_view EventQueue::front_line() const { return {slot_text(head_), slots_[head_].length}; }
+
+const EventMatches& EventQueue::front_matches() const { return slots_[head_].matches; }
+
+void EventQueue::pop() {
+  head_ = (head_ + 1) % slots_.size();
+  --size_;
+}
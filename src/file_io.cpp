@@ -0,0 +1,153 @@
+/*
+ * file_io.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#include "file_io.hpp"
+
+#include <fstream>
+#include <string_view>
+#include <utility>
+
+namespace fs = std::filesystem;
+
+namespace {
+bool read_file(const fs::path& path, std::string& out) {
+  std::ifstream in{path, std::ios::binary};
+  if (!in) {
+    return false;
+  }
+  std::error_code ec;
+  auto size = fs::file_size(path, ec);
+  if (ec) {
+    return false;
+  }
+  out.resize(size);
+  return bool(in.read(out.data(), std::streamsize(size)));
+}
+
+bool write_file(const fs::path& path, std::string_view data, bool append) {
+  std::error_code ec;
+  fs::create_directories(path.parent_path(), ec);
+  std::ofstream out{path, std::ios::binary | (append ? std::ios::app : std::ios::trunc)};
+  return bool(out.write(data.data(), std::streamsize(data.size())).flush());
+}
+
+FileIo::Result result_for(const FileIo::Request& request) {
+  return {.ctx_id = request.ctx_id, .id = request.id, .op = request.op, .ok = true, .data = {}};
+}
+} // namespace
+
+FileIo::~FileIo() {
+  if (!thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard lock{mutex_};
+    stopping_ = true;
+  }
+  wake_.notify_one();
+  thread_.join();
+}
+
+std::uint64_t FileIo::submit(std::uint32_t ctx_id, Op op, fs::path path, fs::path fallback, std::string data) {
+  if (!thread_.joinable()) {
+    thread_ = std::thread{[this] { run(); }};
+  }
+  auto id = ++last_id_;
+  {
+    std::lock_guard lock{mutex_};
+    requests_.push_back({.ctx_id = ctx_id, .id = id, .op = op, .path = std::move(path),
+                         .fallback = std::move(fallback), .data = std::move(data)});
+  }
+  wake_.notify_one();
+  ++pending_;
+  return id;
+}
+
+void FileIo::drain(std::vector<Result>& out) {
+  out.clear();
+  if (pending_ == 0) {
+    return;
+  }
+  {
+    std::lock_guard lock{mutex_};
+    std::swap(out, results_);
+  }
+  pending_ -= out.size();
+}
+
+void FileIo::run() {
+  std::vector<Request> batch;
+  std::vector<Result> done;
+  for (;;) {
+    {
+      std::unique_lock lock{mutex_};
+      wake_.wait(lock, [this] { return stopping_ || !requests_.empty(); });
+      if (requests_.empty()) {
+        return;
+      }
+      // everything queued so far is handled together, that's what lets appends be merged.
+      batch.clear();
+      std::swap(batch, requests_);
+    }
+    done.clear();
+    process(batch, done);
+    std::lock_guard lock{mutex_};
+    for (Result& result : done) {
+      results_.push_back(std::move(result));
+    }
+  }
+}
+
+void FileIo::process(std::vector<Request>& batch, std::vector<Result>& done) {
+  for (std::size_t i = 0; i < batch.size(); ++i) {
+    Request& request = batch[i];
+    // 0 marks an append that was written with an earlier one.
+    if (request.id == 0) {
+      continue;
+    }
+    Result& result = done.emplace_back(result_for(request));
+    if (request.op == Op::Read) {
+      if (read_file(request.path, result.data)) {
+        continue;
+      }
+      if (!request.fallback.empty() && read_file(request.fallback, result.data)) {
+        continue;
+      }
+      result.ok = false;
+      result.data = "can't read " + request.path.generic_string();
+      continue;
+    }
+    if (request.op == Op::Write) {
+      if (!write_file(request.path, request.data, false)) {
+        result.ok = false;
+        result.data = "can't write " + request.path.generic_string();
+      }
+      continue;
+    }
+    // later appends to the same file go along with this one, up to the first request that isn't an append.
+    std::size_t first = done.size() - 1;
+    for (std::size_t j = i + 1; j < batch.size(); ++j) {
+      Request& next = batch[j];
+      if (next.id == 0 || next.path != request.path) {
+        continue;
+      }
+      if (next.op != Op::Append) {
+        break;
+      }
+      request.data += next.data;
+      done.push_back(result_for(next));
+      next.id = 0;
+      ++batched_appends_;
+    }
+    if (!write_file(request.path, request.data, true)) {
+      for (std::size_t k = first; k < done.size(); ++k) {
+        done[k].ok = false;
+        done[k].data = "can't append to " + request.path.generic_string();
+      }
+    }
+  }
+}
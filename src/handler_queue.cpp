@@ -0,0 +1,76 @@
+/*
+ * handler_queue.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#include "handler_queue.hpp"
+#include "luna_context.hpp"
+
+#include <algorithm>
+#include <utility>
+
+void HandlerQueue::begin_frame() {
+  std::swap(current_, next_);
+  // cleared rather than replaced, so the arenas keep their capacity.
+  next_.text.clear();
+  next_.captures.clear();
+  for (auto& calls : next_.calls) {
+    calls.clear();
+  }
+}
+
+void HandlerQueue::add_event(LunaContext* ctx, int fn_key, std::string_view line,
+                             const EventMatches::Capture* captures, std::uint32_t capture_count) {
+  add(current_,
+      {.ctx = ctx,
+       .fn_key = fn_key,
+       .event = true,
+       .text_offset = 0,
+       .text_length = 0,
+       .first_capture = 0,
+       .capture_count = capture_count,
+       .waited = 0},
+      line, captures);
+}
+
+void HandlerQueue::add_bind(LunaContext* ctx, int fn_key, std::string_view args) {
+  add(current_,
+      {.ctx = ctx,
+       .fn_key = fn_key,
+       .event = false,
+       .text_offset = 0,
+       .text_length = 0,
+       .first_capture = 0,
+       .capture_count = 0,
+       .waited = 0},
+      args, nullptr);
+}
+
+void HandlerQueue::carry_over(const Call& call) {
+  Call carried = call;
+  ++carried.waited;
+  add(next_, carried, text(call), captures(call));
+}
+
+void HandlerQueue::add(Frame& frame, const Call& call, std::string_view text, const EventMatches::Capture* captures) {
+  Call& added = frame.calls[std::size_t(call.ctx->priority)].emplace_back(call);
+  added.text_offset = std::uint32_t(frame.text.size());
+  added.text_length = std::uint32_t(text.size());
+  added.first_capture = std::uint32_t(frame.captures.size());
+  frame.text.append(text);
+  if (call.capture_count > 0) {
+    frame.captures.insert(frame.captures.end(), captures, captures + call.capture_count);
+  }
+}
+
+void HandlerQueue::remove_context(const LunaContext* ctx) {
+  // the text and captures of removed calls stay in the arenas until they're cleared.
+  for (Frame* frame : {&current_, &next_}) {
+    for (auto& calls : frame->calls) {
+      calls.erase(std::remove_if(calls.begin(), calls.end(), [ctx](const Call& call) { return call.ctx == ctx; }),
+                  calls.end());
+    }
+  }
+}
@@ -0,0 +1,124 @@
+/*
+ * literal_scanner.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#include "literal_scanner.hpp"
+
+#include <algorithm>
+#include <limits>
+
+namespace {
+constexpr std::size_t max_states = std::numeric_limits<std::uint16_t>::max();
+}
+
+void LiteralScanner::clear() {
+  next_.clear();
+  starts_.reset();
+  out_begin_.clear();
+  out_ids_.clear();
+  seen_marks_.clear();
+  seen_gen_ = 0;
+}
+
+void LiteralScanner::build(const std::vector<std::string_view>& literals) {
+  clear();
+  std::size_t total = 1;
+  for (auto lit : literals) {
+    total += lit.size();
+  }
+  // a table this large would be slower than just running every pattern, leave the scanner empty.
+  if (total >= max_states || literals.empty()) {
+    return;
+  }
+  // build the trie, 0 doubles as "no edge" since nothing transitions into the root.
+  next_.assign(256, 0);
+  std::vector<std::vector<int>> outputs(1);
+  for (auto id = 0u; id < literals.size(); ++id) {
+    auto lit = literals[id];
+    if (lit.empty()) {
+      continue;
+    }
+    std::size_t state = 0;
+    for (char ch : lit) {
+      auto c = static_cast<unsigned char>(ch);
+      if (next_[state * 256 + c] == 0) {
+        next_[state * 256 + c] = outputs.size();
+        outputs.emplace_back();
+        next_.resize(next_.size() + 256, 0);
+      }
+      state = next_[state * 256 + c];
+    }
+    outputs[state].push_back(id);
+  }
+  std::size_t num_states = outputs.size();
+  for (int c = 0; c < 256; ++c) {
+    starts_[c] = next_[c] != 0;
+  }
+
+  // breadth-first so a state's failure link is always finished before the state itself.
+  std::vector<std::uint16_t> fail(num_states, 0);
+  std::vector<std::uint16_t> queue;
+  queue.reserve(num_states);
+  for (int c = 0; c < 256; ++c) {
+    if (next_[c] != 0) {
+      queue.push_back(next_[c]);
+    }
+  }
+  for (auto head = 0u; head < queue.size(); ++head) {
+    std::uint16_t u = queue[head];
+    auto& fail_out = outputs[fail[u]];
+    outputs[u].insert(outputs[u].end(), fail_out.begin(), fail_out.end());
+    for (int c = 0; c < 256; ++c) {
+      std::uint16_t v = next_[u * 256 + c];
+      std::uint16_t fallback = next_[fail[u] * 256 + c];
+      if (v != 0) {
+        fail[v] = fallback;
+        queue.push_back(v);
+      } else {
+        next_[u * 256 + c] = fallback;
+      }
+    }
+  }
+
+  out_begin_.reserve(num_states + 1);
+  for (auto&& out : outputs) {
+    out_begin_.push_back(out_ids_.size());
+    out_ids_.insert(out_ids_.end(), out.begin(), out.end());
+  }
+  out_begin_.push_back(out_ids_.size());
+  seen_marks_.assign(literals.size(), 0);
+}
+
+void LiteralScanner::scan(std::string_view text, std::vector<int>& found) {
+  if (next_.empty()) {
+    return;
+  }
+  if (++seen_gen_ == 0) {
+    std::fill(seen_marks_.begin(), seen_marks_.end(), 0);
+    seen_gen_ = 1;
+  }
+  auto p = reinterpret_cast<const unsigned char*>(text.data());
+  auto end = p + text.size();
+  std::uint16_t state = 0;
+  while (p != end) {
+    if (state == 0) {
+      while (p != end && !starts_[*p]) {
+        ++p;
+      }
+      if (p == end) {
+        break;
+      }
+    }
+    state = next_[state * 256 + *p++];
+    for (auto i = out_begin_[state]; i < out_begin_[state + 1]; ++i) {
+      int id = out_ids_[i];
+      if (seen_marks_[id] != seen_gen_) {
+        seen_marks_[id] = seen_gen_;
+        found.push_back(id);
+      }
+    }
+  }
+}
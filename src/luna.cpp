@@ -7,20 +7,26 @@
 
 #include "luna.hpp"
 #include "mq2_api.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
-#include <windows.h>
 
+#include <algorithm>
+#include <charconv>
 #include <cstring>
+#include <ctime>
+#include <fstream>
+#include <new>
 #include <string_view>
-
-namespace zx {
-char scratch_buf[4096] = {'\0'};
-}
+#include <utility>
 
 namespace {
+bool wakes_later(const ScheduledPulse& a, const ScheduledPulse& b) { return a.wake > b.wake; }
+
 int luna_yield(lua_State* ls) {
-  if (!luna->in_pulse()) {
-    return luaL_error(ls, "yielding is NOT support on non-pulse threads.");
+  // the pulse function and event/bind handlers run on coroutines, anything else (draw_hud, zoned,
+  // handlers over max_suspended_handlers, module load) can't be suspended.
+  if (!lua_isyieldable(ls)) {
+    return luaL_error(ls, "luna.yield can only be used in pulse, event and bind handlers.");
   }
   auto ctx = zx::get_context(ls);
   if (ctx == nullptr) {
@@ -29,75 +35,362 @@ int luna_yield(lua_State* ls) {
   return ctx->yield_event(ls);
 }
 
+int luna_set_budget(lua_State* ls) {
+  auto ctx = zx::get_context(ls);
+  if (ctx == nullptr) {
+    return 0;
+  }
+  return ctx->set_budget(ls);
+}
+
+int luna_spawn(lua_State* ls) {
+  auto ctx = zx::get_context(ls);
+  if (ctx == nullptr) {
+    return 0;
+  }
+  int nres = ctx->spawn(ls);
+  luna->reschedule_if_needed(ctx);
+  return nres;
+}
+
+int luna_cancel(lua_State* ls) {
+  auto ctx = zx::get_context(ls);
+  if (ctx == nullptr) {
+    return 0;
+  }
+  return ctx->cancel(ls);
+}
+
+int luna_async(lua_State* ls) {
+  if (!luna->workers().enabled()) {
+    return luaL_error(ls, "luna.async is disabled, async_workers is 0 in luna_config.lua");
+  }
+  auto ctx = zx::get_context(ls);
+  if (ctx == nullptr) {
+    return 0;
+  }
+  return ctx->async(ls, luna->workers());
+}
+
+int fs_request(lua_State* ls, FileIo::Op op) {
+  auto ctx = zx::get_context(ls);
+  if (ctx == nullptr) {
+    return 0;
+  }
+  return ctx->file_request(ls, luna->file_io(), op, luna->luna_dir());
+}
+
+int luna_fs_read_async(lua_State* ls) { return fs_request(ls, FileIo::Op::Read); }
+int luna_fs_write_async(lua_State* ls) { return fs_request(ls, FileIo::Op::Write); }
+int luna_fs_append_async(lua_State* ls) { return fs_request(ls, FileIo::Op::Append); }
+
 int luna_do(lua_State* ls) {
   auto cmd = luaL_checkstring(ls, 1);
   if (!cmd) {
     return 0;
   }
+  if (auto ctx = LunaContext::of(ls)) {
+    ++ctx->stats.commands;
+  }
   lua_remove(ls, 1);
+  // the command may well change what any cached expression evaluates to.
+  luna->invalidate_data_cache();
   mq2->DoCommand(cmd);
   return 0;
 }
 
-int luna_data(lua_State* ls) {
-  auto cmd = luaL_checkstring(ls, 1);
-  if (!cmd) {
-    return 0;
+using DataConverter = void (*)(const MQ2TypeVar&, DataValue&);
+
+void count_data_call(lua_State* ls) {
+  if (auto ctx = LunaContext::of(ls)) {
+    ++ctx->stats.data_calls;
   }
-  lua_remove(ls, 1);
+}
+
+void convert_int(const MQ2TypeVar& result, DataValue& out) {
+  out.kind = DataValue::Kind::Integer;
+  out.integer = result.Int;
+}
+
+void convert_int64(const MQ2TypeVar& result, DataValue& out) {
+  out.kind = DataValue::Kind::Integer;
+  out.integer = lua_Integer(result.Int64);
+}
+
+void convert_float(const MQ2TypeVar& result, DataValue& out) {
+  out.kind = DataValue::Kind::Number;
+  out.number = result.Float;
+}
+
+void convert_double(const MQ2TypeVar& result, DataValue& out) {
+  out.kind = DataValue::Kind::Number;
+  out.number = result.Double;
+}
+
+void convert_string(const MQ2TypeVar& result, DataValue& out) {
+  if (result.Ptr == nullptr) {
+    out.kind = DataValue::Kind::Nil;
+  } else {
+    out.kind = DataValue::Kind::String;
+    out.string.assign((const char*)result.Ptr);
+  }
+}
+
+void convert_bool(const MQ2TypeVar& result, DataValue& out) {
+  out.kind = DataValue::Kind::Boolean;
+  out.boolean = (bool)result.DWord;
+}
+
+DataConverter converter_for(MQ2Type* type) {
+  if (type == mq2->pIntType) {
+    return convert_int;
+  } else if (type == mq2->pInt64Type) {
+    return convert_int64;
+  } else if (type == mq2->pFloatType) {
+    return convert_float;
+  } else if (type == mq2->pDoubleType) {
+    return convert_double;
+  } else if (type == mq2->pStringType) {
+    return convert_string;
+  }
+  return convert_bool;
+}
+
+void parse_data(const char* expr, DataValue& out) {
   MQ2TypeVar result;
-  if (!mq2->ParseMQ2DataPortion(cmd, result)) {
-    lua_pushnil(ls);
-  } else if (result.Type == mq2->pIntType) {
-    lua_pushinteger(ls, result.Int);
-  } else if (result.Type == mq2->pInt64Type) {
-    lua_pushinteger(ls, lua_Integer(result.Int64));
-  } else if (result.Type == mq2->pFloatType) {
-    lua_pushnumber(ls, result.Float);
-  } else if (result.Type == mq2->pDoubleType) {
-    lua_pushnumber(ls, result.Double);
-  } else if (result.Type == mq2->pStringType) {
-    lua_pushstring(ls, (const char*)result.Ptr);
-  } else if (result.Type == mq2->pBoolType) {
-    lua_pushboolean(ls, (bool)result.DWord);
+  if (!mq2->ParseMQ2DataPortion(expr, result)) {
+    out.kind = DataValue::Kind::Nil;
   } else {
-    lua_pushboolean(ls, (bool)result.DWord);
+    converter_for(result.Type)(result, out);
   }
-  return 1;
 }
 
-int luna_echo(lua_State* ls) {
-  auto msg = luaL_checkstring(ls, 1);
-  if (!msg) {
-    return 0;
+// MQ2 parses out of a fixed 4096 byte buffer.
+constexpr size_t max_data_expr = 4095;
+// a module that hasn't been compiled on the workers after this many frames is loaded on the game thread.
+constexpr std::uint32_t max_compile_wait_frames = 10;
+// upper bound for the memory limits in luna_config.lua, 1 GB.
+constexpr lua_Integer max_memory_limit_kb = 1024 * 1024;
+constexpr const char* data_query_meta = "luna.DataQuery";
+
+// a luna.prepare handle. buf is sized once to the full MQ2 parse buffer and the converter is looked up
+// again only when the result type changes, so evaluating it is a memcpy and the MQ2 call.
+struct DataQuery {
+  std::string expr;
+  std::string buf;
+  MQ2Type* type = nullptr;
+  DataConverter convert = nullptr;
+  std::uint64_t generation = 0;
+  DataValue value;
+};
+
+void evaluate(DataQuery& q) {
+  // MQ2 is free to write into the buffer, so it's refreshed from expr every time.
+  std::memcpy(q.buf.data(), q.expr.c_str(), q.expr.size() + 1);
+  MQ2TypeVar result;
+  if (!mq2->ParseMQ2DataPortionInPlace(q.buf.data(), result)) {
+    q.value.kind = DataValue::Kind::Nil;
+    return;
   }
-  lua_remove(ls, 1);
-  mq2->WriteChatColor(msg);
+  if (result.Type != q.type || q.convert == nullptr) {
+    q.type = result.Type;
+    q.convert = converter_for(result.Type);
+  }
+  q.convert(result, q.value);
+}
+
+int data_query_call(lua_State* ls) {
+  auto q = static_cast<DataQuery*>(luaL_checkudata(ls, 1, data_query_meta));
+  count_data_call(ls);
+  auto cache = luna->data_cache();
+  if (cache == nullptr || !cache->fresh(q->generation)) {
+    evaluate(*q);
+  }
+  q->value.push(ls);
+  return 1;
+}
+
+int data_query_gc(lua_State* ls) {
+  auto q = static_cast<DataQuery*>(luaL_checkudata(ls, 1, data_query_meta));
+  q->~DataQuery();
   return 0;
 }
 
-int luna_bind(lua_State* ls) { return luna->add_bind(ls); }
+int data_query_tostring(lua_State* ls) {
+  auto q = static_cast<DataQuery*>(luaL_checkudata(ls, 1, data_query_meta));
+  lua_pushfstring(ls, "DataQuery(%s)", q->expr.c_str());
+  return 1;
+}
 
-int luna_add_event(lua_State* ls) {
-  auto ctx = zx::get_context(ls);
-  if (ctx != nullptr) {
-    ctx->add_event_binding(ls);
+int luna_prepare(lua_State* ls) {
+  size_t len;
+  auto expr = luaL_checklstring(ls, 1, &len);
+  luaL_argcheck(ls, len > 0 && len <= max_data_expr, 1, "expression is empty or too long");
+  luaL_argcheck(ls, std::strlen(expr) == len, 1, "expression contains embedded zeros");
+  auto q = new (lua_newuserdatauv(ls, sizeof(DataQuery), 0)) DataQuery{};
+  if (luaL_newmetatable(ls, data_query_meta)) {
+    const luaL_Reg meta[] = {
+        {"__call", data_query_call},
+        {"__gc", data_query_gc},
+        {"__tostring", data_query_tostring},
+        {nullptr, nullptr},
+    };
+    luaL_setfuncs(ls, meta, 0);
   }
+  lua_setmetatable(ls, -2);
+  q->expr.assign(expr, len);
+  // MQ2 may write anywhere in the 4096 bytes it expects, not just up to the terminator.
+  q->buf.resize(max_data_expr + 1);
+  return 1;
+}
+
+int data_volatile(lua_State* ls) {
+  // reused so string results don't allocate on every call.
+  static DataValue scratch;
+  parse_data(luaL_checkstring(ls, 1), scratch);
+  scratch.push(ls);
+  return 1;
+}
+
+int luna_data_volatile(lua_State* ls) {
+  count_data_call(ls);
+  return data_volatile(ls);
+}
+
+int luna_data(lua_State* ls) {
+  count_data_call(ls);
+  auto cache = luna->data_cache();
+  if (cache == nullptr) {
+    return data_volatile(ls);
+  }
+  size_t len;
+  auto expr = luaL_checklstring(ls, 1, &len);
+  std::string_view sv{expr, len};
+  if (auto value = cache->find(sv)) {
+    value->push(ls);
+    return 1;
+  }
+  auto& slot = cache->store(sv);
+  parse_data(expr, slot);
+  slot.push(ls);
+  return 1;
+}
+
+// state shared by luna.data_batch calls: one parse buffer, and the converter of the last result type
+// since most expressions in a batch come back as the same few types.
+struct DataBatch {
+  // the full 4096 bytes MQ2 parses in, it may write past the expression's terminator.
+  char buf[max_data_expr + 1];
+  MQ2Type* type = nullptr;
+  DataConverter convert = nullptr;
+  DataValue value;
+};
+
+// evaluates the expression at idx and pushes the result.
+void push_batch_value(lua_State* ls, int idx, DataBatch& batch, DataCache* cache) {
+  if (lua_type(ls, idx) != LUA_TSTRING) {
+    luaL_error(ls, "data_batch expects a table of strings, got a %s", luaL_typename(ls, idx));
+    return;
+  }
+  size_t len;
+  auto expr = lua_tolstring(ls, idx, &len);
+  if (len > max_data_expr) {
+    luaL_error(ls, "data_batch expression is too long");
+    return;
+  }
+  std::string_view sv{expr, len};
+  if (cache != nullptr) {
+    if (auto value = cache->find(sv)) {
+      value->push(ls);
+      return;
+    }
+  }
+  DataValue& out = cache != nullptr ? cache->store(sv) : batch.value;
+  std::memcpy(batch.buf, expr, len + 1);
+  MQ2TypeVar result;
+  if (!mq2->ParseMQ2DataPortionInPlace(batch.buf, result)) {
+    out.kind = DataValue::Kind::Nil;
+  } else {
+    if (result.Type != batch.type || batch.convert == nullptr) {
+      batch.type = result.Type;
+      batch.convert = converter_for(result.Type);
+    }
+    batch.convert(result, out);
+  }
+  out.push(ls);
+}
+
+// luna.data_batch({"${Me.PctHPs}", ...}) returns an array of results in the same order,
+// luna.data_batch({hp = "${Me.PctHPs}", ...}) returns a table with the same keys.
+int luna_data_batch(lua_State* ls) {
+  static DataBatch batch;
+  luaL_checktype(ls, 1, LUA_TTABLE);
+  count_data_call(ls);
+  lua_settop(ls, 1);
+  auto cache = luna->data_cache();
+  auto n = lua_Integer(lua_rawlen(ls, 1));
+  if (n > 0) {
+    lua_createtable(ls, int(n), 0);
+    for (lua_Integer i = 1; i <= n; ++i) {
+      lua_rawgeti(ls, 1, i);
+      push_batch_value(ls, -1, batch, cache);
+      lua_rawseti(ls, 2, i);
+      lua_pop(ls, 1);
+    }
+    return 1;
+  }
+  int count = 0;
+  lua_pushnil(ls);
+  while (lua_next(ls, 1) != 0) {
+    ++count;
+    lua_pop(ls, 1);
+  }
+  lua_createtable(ls, 0, count);
+  lua_pushnil(ls);
+  while (lua_next(ls, 1) != 0) {
+    // stack: ..., result, key, expr
+    push_batch_value(ls, -1, batch, cache);
+    lua_pushvalue(ls, -3);
+    lua_insert(ls, -2);
+    lua_rawset(ls, 2);
+    lua_pop(ls, 1);
+  }
+  return 1;
+}
+
+int luna_echo(lua_State* ls) {
+  size_t len;
+  auto msg = luaL_checklstring(ls, 1, &len);
+  zx::chat_queue.push({msg, len});
   return 0;
 }
 
+int luna_bind(lua_State* ls) { return luna->add_bind(ls); }
+
+int luna_add_event(lua_State* ls) { return luna->add_event(ls); }
+
 int luna_add_raw_event(lua_State* ls) {
   // TODO
   return 0;
 }
 
 int luna_cur_time(lua_State* ls) {
-  auto now = std::chrono::steady_clock::now();
+  auto now = zx::now();
   auto seconds_since_epoch = std::chrono::duration_cast<std::chrono::duration<double>>(now.time_since_epoch()).count();
   lua_pushnumber(ls, seconds_since_epoch);
   return 1;
 }
 
+// the innermost Lua function on thread's stack, skipping C functions such as the luna.yield it's suspended in.
+bool innermost_lua_frame(lua_State* thread, lua_Debug& ar) {
+  for (int level = 0; lua_getstack(thread, level, &ar); ++level) {
+    if (lua_getinfo(thread, "Sl", &ar) && ar.currentline >= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
 void dumpstack(lua_State* L) {
   int top = lua_gettop(L);
   for (int i = 1; i <= top; i++) {
@@ -121,6 +414,65 @@ void dumpstack(lua_State* L) {
   }
 }
 
+const char* const priority_names[] = {"combat", "utility", "cosmetic"};
+static_assert(sizeof(priority_names) / sizeof(priority_names[0]) == std::size_t(Priority::Count));
+
+// the number on top of the stack clamped to [lo, hi], a negative size would otherwise wrap around to a huge one.
+lua_Integer config_integer(lua_State* l, const char* name, lua_Integer lo, lua_Integer hi) {
+  auto value = lua_tointeger(l, -1);
+  auto clamped = std::clamp(value, lo, hi);
+  if (clamped != value) {
+    LOG("%s = %lld is out of range, using %lld.", name, (long long)value, (long long)clamped);
+  }
+  return clamped;
+}
+
+// reads the fields of the table at idx into conf, fields that aren't set are left alone.
+void read_module_config(lua_State* l, int idx, ModuleConfig& conf) {
+  if (lua_getfield(l, idx, "memory_limit_kb") == LUA_TNUMBER) {
+    conf.memory_limit_kb = config_integer(l, "memory_limit_kb", 0, max_memory_limit_kb);
+  }
+  lua_pop(l, 1);
+  if (lua_getfield(l, idx, "max_suspended_handlers") == LUA_TNUMBER) {
+    conf.max_suspended_handlers = config_integer(l, "max_suspended_handlers", 0, 4096);
+  }
+  lua_pop(l, 1);
+  if (lua_getfield(l, idx, "priority") == LUA_TSTRING) {
+    std::string_view name = lua_tostring(l, -1);
+    auto it = std::find(std::begin(priority_names), std::end(priority_names), name);
+    if (it != std::end(priority_names)) {
+      conf.priority = Priority(it - std::begin(priority_names));
+    } else {
+      LOG("unknown priority '%s', keeping %s.", name.data(), priority_names[std::size_t(conf.priority)]);
+    }
+  }
+  lua_pop(l, 1);
+  if (lua_getfield(l, idx, "gc_mode") == LUA_TSTRING) {
+    std::string_view mode = lua_tostring(l, -1);
+    if (mode == "incremental") {
+      conf.gc_mode = GcMode::Incremental;
+    } else if (mode == "generational") {
+      conf.gc_mode = GcMode::Generational;
+    } else {
+      LOG("unknown gc_mode '%s', keeping %s.", mode.data(),
+          conf.gc_mode == GcMode::Incremental ? "incremental" : "generational");
+    }
+  }
+  lua_pop(l, 1);
+  if (lua_getfield(l, idx, "gc_pause") == LUA_TNUMBER) {
+    conf.gc_pause = int(config_integer(l, "gc_pause", 0, 1000));
+  }
+  lua_pop(l, 1);
+  if (lua_getfield(l, idx, "gc_stepmul") == LUA_TNUMBER) {
+    conf.gc_stepmul = int(config_integer(l, "gc_stepmul", 0, 1000));
+  }
+  lua_pop(l, 1);
+  if (lua_getfield(l, idx, "gc_minor_mul") == LUA_TNUMBER) {
+    conf.gc_minor_mul = int(config_integer(l, "gc_minor_mul", 0, 100));
+  }
+  lua_pop(l, 1);
+}
+
 int luna_dump_stack(lua_State* ls) {
   dumpstack(ls);
   return 0;
@@ -128,8 +480,15 @@ int luna_dump_stack(lua_State* ls) {
 
 const luaL_Reg luna_lib[] = {
     {"yield", luna_yield},
+    {"set_budget", luna_set_budget},
+    {"spawn", luna_spawn},
+    {"cancel", luna_cancel},
+    {"async", luna_async},
     {"do_command", luna_do},
     {"data", luna_data},
+    {"data_volatile", luna_data_volatile},
+    {"prepare", luna_prepare},
+    {"data_batch", luna_data_batch},
     {"echo", luna_echo},
     {"bind", luna_bind},
     {"add_event", luna_add_event},
@@ -139,19 +498,82 @@ const luaL_Reg luna_lib[] = {
     {nullptr, nullptr},
 };
 
+const luaL_Reg luna_fs_lib[] = {
+    {"read_async", luna_fs_read_async},
+    {"write_async", luna_fs_write_async},
+    {"append_async", luna_fs_append_async},
+    {nullptr, nullptr},
+};
+
+int open_luna(lua_State* ls) {
+  luaL_newlib(ls, luna_lib);
+  luaL_newlib(ls, luna_fs_lib);
+  lua_setfield(ls, -2, "fs");
+  return 1;
+}
+
+// a combat tick's worth of reads, timed one by one through luna.data and then through luna.data_batch.
+const char* const data_bench_exprs[] = {
+    "${Me.PctHPs}",      "${Me.PctMana}",      "${Me.PctEndurance}", "${Me.Combat}",      "${Me.Casting.ID}",
+    "${Me.Moving}",      "${Me.Sitting}",      "${Me.Level}",        "${Me.Name}",        "${Me.X}",
+    "${Me.Y}",           "${Me.Z}",            "${Me.Heading}",      "${Me.XTarget}",     "${Target.ID}",
+    "${Target.PctHPs}",  "${Target.Distance}", "${Target.Type}",     "${Target.Name}",    "${Zone.ShortName}",
+};
+
+constexpr const char* data_bench_chunk = R"(
+local exprs, rounds = ...
+local data, data_batch, clock = luna.data, luna.data_batch, os.clock
+local start = clock()
+for _ = 1, rounds do
+  for i = 1, #exprs do
+    local _ = data(exprs[i])
+  end
+end
+local single = clock() - start
+start = clock()
+for _ = 1, rounds do
+  local _ = data_batch(exprs)
+end
+return single, clock() - start
+)";
+
 } // namespace
 
 Luna::Luna() {
   if (mq2->mq2_dir != nullptr) {
     modules_dir = fs::path{mq2->mq2_dir};
     modules_dir.replace_filename("luna");
+    bytecode_cache_.set_dir(modules_dir / "cache");
   } else {
     LOG("failed to locate the mq2 dir, serious error.");
   }
   load_config();
+  todo_events_.reserve(config_.event_queue_size, config_.event_queue_overflow);
+  workers_.configure(config_.async_workers, config_.async_memory_limit_kb * 1024);
+  // through the command queue, modules can't be started before the global luna is set.
+  if (!config_.autostart.empty()) {
+    std::string cmd = "run";
+    for (const std::string& name : config_.autostart) {
+      cmd += " " + name;
+    }
+    todo_luna_cmds_.push_back(std::move(cmd));
+  }
 }
 
-Luna::~Luna() { luna_ctxs_.clear(); }
+Luna::~Luna() {
+  event_matcher_.clear();
+  bind_router_.clear();
+  luna_ctxs_.clear();
+  state_pool_.clear();
+  flush_chat(0);
+}
+
+void Luna::flush_chat(std::size_t budget) {
+  if (zx::chat_queue.empty()) {
+    return;
+  }
+  zx::chat_queue.flush(budget, [](char* line) { mq2->WriteChatColorInPlace(line); });
+}
 
 void Luna::Cmd(const char* cmd) {
   if (cmd == nullptr) {
@@ -160,14 +582,44 @@ void Luna::Cmd(const char* cmd) {
   todo_luna_cmds_.emplace_back(std::string{cmd});
 }
 
-void Luna::BoundCommand(const char* cmd) { todo_bind_commands_.push_back(std::string{cmd}); }
+void Luna::BoundCommand(const char* cmd) {
+  if (cmd == nullptr) {
+    return;
+  }
+  todo_bind_commands_.push(cmd);
+}
 
 void Luna::print_info() {
-  LOG("Active modules: %d", luna_ctxs_.size());
+  LOG("Active modules: %zu", luna_ctxs_.size());
+  LOG("Bytecode cache: %llu hits, %llu misses", (unsigned long long)bytecode_cache_.hits,
+      (unsigned long long)bytecode_cache_.misses);
+  LOG("Prepared states: %zu of %zu", state_pool_.size(), config_.state_pool_size);
+  LOG("Frames over the %zu us budget: %llu of %llu", config_.frame_budget_us, (unsigned long long)over_budget_frames_,
+      (unsigned long long)frames_);
+  LOG("Async jobs pending: %zu, modules waiting to start: %zu", workers_.pending(), pending_runs_.size());
+  if (zx::trace_recorder.recording()) {
+    LOG("Recording: %llu records so far", (unsigned long long)zx::trace_recorder.records);
+  }
+  LOG("File requests pending: %zu, %llu appends batched", file_io_.pending(),
+      (unsigned long long)file_io_.batched_appends());
+  LOG("Chat output: %llu lines written, %llu merged, %llu dropped", (unsigned long long)zx::chat_queue.written,
+      (unsigned long long)zx::chat_queue.merged, (unsigned long long)zx::chat_queue.dropped);
+  if (config_.cache_data) {
+    LOG("Data cache: %llu hits, %llu misses", (unsigned long long)data_cache_.hits,
+        (unsigned long long)data_cache_.misses);
+  }
   for (auto&& ls : luna_ctxs_) {
     LOG("=====================");
     LOG("Name: %s", ls->name.c_str());
     LOG("Paused: %s", ls->paused ? "true" : "false");
+    LOG("Priority: %s", priority_names[std::size_t(ls->priority)]);
+    LOG("Pulse preemptions: %llu", (unsigned long long)ls->preemptions);
+    LOG("Suspended handlers: %zu of %zu", ls->suspended_handlers(), ls->max_suspended_handlers);
+    for (auto&& [id, task] : ls->tasks()) {
+      double cpu_ms = std::chrono::duration<double, std::milli>(task.cpu_time).count();
+      LOG(" %s %u: %s, %.2f ms cpu %s", task.kind, id, task.wake > frame_time_ ? "sleeping" : "ready", cpu_ms,
+          task.source.c_str());
+    }
     // TODO
     LOG(" Main thread stack size: %d", lua_gettop(ls->threads_.main));
     dumpstack(ls->threads_.main);
@@ -177,14 +629,44 @@ void Luna::print_info() {
     dumpstack(ls->threads_.event);
     LOG(" Bind thread stack size: %d", lua_gettop(ls->threads_.bind));
     dumpstack(ls->threads_.bind);
-    LOG("Memory usage: NYI");
-    LOG("Current line: NYI");
+    auto mem = ls->memory_stats();
+    LOG("Memory usage: %zu KB (peak %zu KB, %zu KB in pools)", mem.current_bytes / 1024, mem.peak_bytes / 1024,
+        mem.chunk_bytes / 1024);
+    LOG(" allocations: %llu frees: %llu refused: %llu limit: %zu KB", (unsigned long long)mem.allocations,
+        (unsigned long long)mem.frees, (unsigned long long)mem.refusals, ls->memory_limit() / 1024);
+    lua_Debug ar;
+    if (ls->pulse_yielding && innermost_lua_frame(ls->threads_.pulse, ar)) {
+      LOG("Current line: %s:%d", ar.short_src, ar.currentline);
+    } else {
+      LOG("Current line: not running");
+    }
+  }
+}
+
+void Luna::print_event_stats() {
+  const EventQueue::Stats& queue = todo_events_.stats();
+  LOG("Queue: %zu of %zu, high water %zu, %llu enqueued, %llu dropped", todo_events_.size(), todo_events_.capacity(),
+      queue.high_water, (unsigned long long)queue.enqueued, (unsigned long long)queue.dropped);
+  for (auto id = 0u; id < event_matcher_.pattern_count(); ++id) {
+    const EventMatcher::Pattern& p = event_matcher_.pattern(id);
+    if (!p.live) {
+      continue;
+    }
+    auto stats = event_matcher_.stats(id);
+    LOG("%s: |%s| %s", p.ctx->name.c_str(), p.source.c_str(), p.in_automaton ? "" : "(std::regex)");
+    LOG("  literal: |%s| passed: %llu rejected: %llu matched: %llu", p.literal.c_str(),
+        (unsigned long long)stats.passed, (unsigned long long)stats.rejected, (unsigned long long)stats.matched);
   }
 }
 
 void Luna::print_help() {
-  LOG("Usage: /luna {run|stop|pause} {module_name|all}");
-  LOG("Usage: /luna {info|help|list}");
+  LOG("Usage: /luna run {module_name ...|all}");
+  LOG("Usage: /luna {stop|pause} {module_name|all}");
+  LOG("Usage: /luna {info|help|list|events}");
+  LOG("Usage: /luna profile {start|stop} module_name");
+  LOG("Usage: /luna bench data [rounds]");
+  LOG("Usage: /luna record {start [file]|stop}");
+  LOG("Usage: /luna stats [module_name|reset [module_name]|dump [file]]");
 }
 
 void Luna::list_available_modules() {
@@ -196,7 +678,7 @@ void Luna::list_available_modules() {
     }
     ++num_modules;
     if (fs::exists(path.append("module.lua"))) {
-      LOG("   %ls", p.path().filename().c_str());
+      LOG("   %s", p.path().filename().string().c_str());
     }
   }
   if (num_modules == 1) {
@@ -206,6 +688,88 @@ void Luna::list_available_modules() {
   }
 }
 
+std::string Luna::search_path_for(const fs::path& module_dir) const {
+  auto search_path = modules_dir.generic_string();
+  return module_dir.generic_string() + "/?.lua;" + search_path + "/lib/?.lua;" + search_path + "/lib/?/init.lua;";
+}
+
+void Luna::run_modules(std::string_view names) {
+  if (names == "all") {
+    std::vector<std::string> all;
+    std::error_code ec;
+    for (auto& p : fs::directory_iterator(modules_dir, ec)) {
+      if (fs::is_regular_file(p.path() / "module.lua", ec)) {
+        all.push_back(p.path().filename().string());
+      }
+    }
+    std::sort(all.begin(), all.end());
+    for (const std::string& name : all) {
+      if (find_index_of(name) == -1) {
+        queue_module(name);
+      }
+    }
+    return;
+  }
+  while (!names.empty()) {
+    auto end = std::min(names.find(' '), names.size());
+    if (end > 0) {
+      queue_module(std::string{names.substr(0, end)});
+    }
+    names.remove_prefix(std::min(end + 1, names.size()));
+  }
+}
+
+void Luna::queue_module(const std::string& name) {
+  auto module_path = modules_dir / name / "module.lua";
+  std::error_code ec;
+  // without workers, or for modules run_module is going to refuse anyway, there's nothing to compile.
+  if (!workers_.enabled() || find_index_of(name) != -1 || !fs::is_regular_file(module_path, ec)) {
+    if (pending_runs_.empty()) {
+      run_module(name);
+    } else {
+      pending_runs_.push_back({.name = name, .job_id = 0, .compiled = true, .frames_waited = 0, .chunks = {}});
+    }
+    return;
+  }
+  for (const PendingRun& pending : pending_runs_) {
+    if (pending.name == name) {
+      LOG("module %s is already starting.", name.c_str());
+      return;
+    }
+  }
+  auto job_id = workers_.submit_compile(bytecode_cache_, module_path.generic_string(),
+                                        search_path_for(modules_dir / name));
+  pending_runs_.push_back({.name = name, .job_id = job_id, .compiled = false, .frames_waited = 0, .chunks = {}});
+}
+
+void Luna::start_compiled_modules() {
+  if (pending_runs_.empty()) {
+    return;
+  }
+  for (PendingRun& pending : pending_runs_) {
+    if (!pending.compiled) {
+      ++pending.frames_waited;
+    }
+  }
+  // in the order they were asked for, a module still compiling holds up the ones after it for a few frames.
+  // Past that it's compiled here by load_file, and its job's result is dropped when it comes in.
+  while (!pending_runs_.empty()) {
+    PendingRun& pending = pending_runs_.front();
+    if (!pending.compiled && pending.frames_waited < max_compile_wait_frames) {
+      break;
+    }
+    if (!pending.compiled) {
+      DLOG("module %s is still waiting for a worker, compiling it now.", pending.name.c_str());
+    }
+    bytecode_cache_.preload(pending.chunks);
+    run_module(pending.name);
+    pending_runs_.pop_front();
+  }
+  if (pending_runs_.empty()) {
+    bytecode_cache_.clear_preloaded();
+  }
+}
+
 void Luna::run_module(std::string_view sv) {
   auto idx = find_index_of(sv);
   if (idx != -1) {
@@ -223,44 +787,69 @@ void Luna::run_module(std::string_view sv) {
     LOG("module %s requires a module.lua", sv.data());
     return;
   }
-  auto ls = std::make_unique<LunaContext>(std::string(sv));
-  auto search_path = modules_dir.generic_string();
-  std::string lua_search_path =
-      module_dir.generic_string() + "?.lua;" + search_path + "/lib/?.lua;" + search_path + "/lib/?/init.lua;";
-  ls->set_search_path(lua_search_path.c_str());
+  // the state comes with the libs and the luna table installed, only the module specifics are left.
+  auto ls = std::make_unique<LunaContext>(std::string(sv), take_prepared_state());
+  ls->id = ++last_ctx_id_;
+  ls->dir = module_dir;
+  const ModuleConfig& conf = config_.for_module(sv);
+  ls->set_memory_limit(conf.memory_limit_kb * 1024);
+  ls->max_suspended_handlers = conf.max_suspended_handlers;
+  ls->configure_gc(conf);
+  ls->priority = conf.priority;
+  ls->set_search_path(search_path_for(module_dir).c_str());
   DLOG("adding path %s", module_dir.generic_string().c_str());
   lua_State* main_thread = ls->threads_.main;
-  luaL_newlib(main_thread, luna_lib);
-  lua_setglobal(main_thread, "luna");
   DLOG("running module path %s", module_path.generic_string().c_str());
-  if (luaL_dofile(main_thread, module_path.generic_string().c_str()) != LUA_OK) {
+  // the module body may have added binds and events already, they have to go with it.
+  auto run_body = [&] {
+    auto armed = ls->arm_memory_limit();
+    return lua_pcall(main_thread, 0, LUA_MULTRET, 0);
+  };
+  if (bytecode_cache_.load_file(main_thread, module_path) != LUA_OK || run_body() != LUA_OK) {
     LOG("error running lua module: %s", lua_tostring(main_thread, -1));
+    unregister_context(ls.get());
     return;
   }
   if (!lua_istable(main_thread, -1)) {
     LOG("1:error running %s, refer to the examples.", sv.data());
+    unregister_context(ls.get());
     return;
   }
   lua_setglobal(main_thread, module_global);
   if (!ls->create_indices()) {
     LOG("2:error running %s, refer to the examples.", sv.data());
+    unregister_context(ls.get());
     return;
   }
+  schedule_pulse(ls.get(), zx::now());
   luna_ctxs_.emplace_back(std::move(ls));
 }
 
 void Luna::stop_module(std::string_view sv) {
   if (sv == "all") {
     LOG("stopping ALL modules.");
+    pending_runs_.clear();
+    bytecode_cache_.clear_preloaded();
+    for (auto&& ctx : luna_ctxs_) {
+      unregister_context(ctx.get());
+    }
     luna_ctxs_.clear();
     return;
   }
+  auto pending = std::find_if(pending_runs_.begin(), pending_runs_.end(),
+                              [sv](const PendingRun& pending) { return pending.name == sv; });
+  if (pending != pending_runs_.end()) {
+    LOG("module %s won't be started.", pending->name.c_str());
+    pending_runs_.erase(pending);
+    return;
+  }
   auto idx = find_index_of(sv);
   if (idx == -1) {
     LOG("module %s isn't running.", sv.data());
     return;
   }
   LOG("Stopping module %s.", luna_ctxs_[idx]->name.c_str());
+  unregister_context(luna_ctxs_[idx].get());
   luna_ctxs_.erase(luna_ctxs_.begin() + idx);
 }
 
@@ -274,10 +863,244 @@ void Luna::pause_module(std::string_view sv) {
   if (ls->paused) {
     LOG("Unpausing module %s.", luna_ctxs_[idx]->name.c_str());
     ls->paused = false;
+    schedule_pulse(ls.get(), ls->next_wake(frame_time_));
     return;
   }
   LOG("Pausing module %s.", luna_ctxs_[idx]->name.c_str());
   ls->paused = true;
+  unschedule_pulse(ls.get());
+}
+
+void Luna::profile_command(std::string_view sv) {
+  bool start = sv.starts_with("start ");
+  if (!start && !sv.starts_with("stop ")) {
+    print_help();
+    return;
+  }
+  sv.remove_prefix(start ? 6 : 5);
+  sv.remove_prefix(std::min(sv.find_first_not_of(" "), sv.size()));
+  auto idx = find_index_of(sv);
+  if (idx == -1) {
+    LOG("module %s isn't running.", sv.data());
+    return;
+  }
+  auto& ctx = luna_ctxs_[idx];
+  if (start) {
+    if (ctx->profiling()) {
+      LOG("module %s is already being profiled.", ctx->name.c_str());
+      return;
+    }
+    LOG("profiling module %s.", ctx->name.c_str());
+    ctx->start_profile();
+    return;
+  }
+  if (!ctx->profiling()) {
+    LOG("module %s isn't being profiled.", ctx->name.c_str());
+    return;
+  }
+  write_profile(*ctx);
+}
+
+void Luna::record_command(std::string_view sv) {
+  if (sv == "stop") {
+    if (!zx::trace_recorder.recording()) {
+      LOG("not recording.");
+      return;
+    }
+    zx::trace_recorder.stop();
+    LOG("recording stopped, %llu records in %llu bytes.", (unsigned long long)zx::trace_recorder.records,
+        (unsigned long long)zx::trace_recorder.bytes);
+    return;
+  }
+  if (!sv.starts_with("start")) {
+    LOG("Usage: /luna record {start [file]|stop}");
+    return;
+  }
+  sv.remove_prefix(5);
+  sv.remove_prefix(std::min(sv.find_first_not_of(" "), sv.size()));
+  auto path = modules_dir / "traces";
+  if (sv.empty()) {
+    char name[64];
+    auto t = std::time(nullptr);
+    std::strftime(name, sizeof(name), "trace-%Y%m%d-%H%M%S.ltr", std::localtime(&t));
+    path /= name;
+  } else {
+    path /= fs::path{sv};
+  }
+  if (!zx::trace_recorder.start(path)) {
+    LOG("can't write %s.", path.string().c_str());
+    return;
+  }
+  // a replay has to start with the modules that are running now.
+  if (!luna_ctxs_.empty()) {
+    std::string cmd = "run";
+    for (auto&& ctx : luna_ctxs_) {
+      cmd += " " + ctx->name;
+    }
+    zx::trace_recorder.command(TraceKind::LunaCommand, cmd);
+  }
+  LOG("recording to %s.", path.string().c_str());
+}
+
+void Luna::stats_command(std::string_view sv) {
+  if (sv.starts_with("reset")) {
+    sv.remove_prefix(5);
+    sv.remove_prefix(std::min(sv.find_first_not_of(" "), sv.size()));
+    for (auto&& ctx : luna_ctxs_) {
+      if (sv.empty() || ctx->name == sv) {
+        ctx->stats.reset();
+      }
+    }
+    if (sv.empty()) {
+      frames_ = 0;
+      over_budget_frames_ = 0;
+    }
+    LOG("stats reset for %s.", sv.empty() ? "all modules" : std::string{sv}.c_str());
+    return;
+  }
+  if (sv.starts_with("dump")) {
+    sv.remove_prefix(4);
+    sv.remove_prefix(std::min(sv.find_first_not_of(" "), sv.size()));
+    write_stats(sv);
+    return;
+  }
+  if (sv.empty()) {
+    LOG("%llu of %llu frames over budget", (unsigned long long)over_budget_frames_, (unsigned long long)frames_);
+    for (auto&& ctx : luna_ctxs_) {
+      print_stats(*ctx, false);
+    }
+    return;
+  }
+  auto idx = find_index_of(sv);
+  if (idx == -1) {
+    LOG("module %s isn't running.", std::string{sv}.c_str());
+    return;
+  }
+  print_stats(*luna_ctxs_[idx], true);
+}
+
+void Luna::print_stats(const LunaContext& ctx, bool all_hooks) {
+  const ModuleStats& stats = ctx.stats;
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - stats.since).count();
+  LOG("%s, over %.1fs: %llu resumes, %llu gc cycles, %.2f ms in %llu idle gc steps", ctx.name.c_str(), seconds,
+      (unsigned long long)stats.resumes, (unsigned long long)stats.gc_cycles,
+      std::chrono::duration<double, std::milli>(stats.gc_time).count(), (unsigned long long)stats.gc_steps);
+  LOG("  events: %llu matched, %llu dispatched; %llu data calls, %llu commands; %llu deferrals",
+      (unsigned long long)stats.events_matched, (unsigned long long)stats.events_dispatched,
+      (unsigned long long)stats.data_calls, (unsigned long long)stats.commands, (unsigned long long)stats.deferrals);
+  // without all_hooks only the pulse function, the rest when asked for the one module.
+  for (auto hook = 0u; hook < (all_hooks ? std::size_t(StatsHook::Count) : 1); ++hook) {
+    const LatencyHistogram& h = stats.latency(StatsHook(hook));
+    if (h.count() == 0) {
+      continue;
+    }
+    LOG("  %s: %llu calls, %.2f ms total, p50 %.1f us, p99 %.1f us, max %.1f us", stats_hook_name(StatsHook(hook)),
+        (unsigned long long)h.count(), double(h.total_ns()) / 1e6, double(h.percentile_ns(0.5)) / 1e3,
+        double(h.percentile_ns(0.99)) / 1e3, double(h.max_ns()) / 1e3);
+  }
+}
+
+void Luna::write_stats(std::string_view file) {
+  auto dir = modules_dir / "stats";
+  std::error_code ec;
+  fs::create_directories(dir, ec);
+  auto path = dir / (file.empty() ? fs::path{"stats.json"} : fs::path{file});
+  std::ofstream out{path, std::ios::trunc};
+  if (!out) {
+    LOG("unable to write stats to %s", path.generic_string().c_str());
+    return;
+  }
+  // JSON, latencies in nanoseconds. Module names are directory names, nothing in them needs escaping.
+  auto now = std::chrono::steady_clock::now();
+  out << "{\"frames\": " << frames_ << ", \"over_budget_frames\": " << over_budget_frames_ << ", \"modules\": [";
+  const char* sep = "\n";
+  for (auto&& ctx : luna_ctxs_) {
+    const ModuleStats& stats = ctx->stats;
+    out << sep << "  {\"name\": \"" << ctx->name << "\", \"priority\": \""
+        << priority_names[std::size_t(ctx->priority)] << "\", \"seconds\": "
+        << std::chrono::duration<double>(now - stats.since).count() << ", \"resumes\": " << stats.resumes
+        << ", \"events_matched\": " << stats.events_matched << ", \"events_dispatched\": " << stats.events_dispatched
+        << ", \"data_calls\": " << stats.data_calls << ", \"commands\": " << stats.commands << ", \"deferrals\": "
+        << stats.deferrals << ", \"gc_cycles\": " << stats.gc_cycles << ", \"gc_steps\": " << stats.gc_steps
+        << ", \"gc_time\": "
+        << std::chrono::duration_cast<std::chrono::nanoseconds>(stats.gc_time).count() << ",\n   \"latency\": {";
+    for (auto hook = 0u; hook < std::size_t(StatsHook::Count); ++hook) {
+      const LatencyHistogram& h = stats.latency(StatsHook(hook));
+      out << (hook == 0 ? "" : ", ") << '"' << stats_hook_name(StatsHook(hook)) << "\": {\"count\": " << h.count()
+          << ", \"total\": " << h.total_ns() << ", \"p50\": " << h.percentile_ns(0.5)
+          << ", \"p99\": " << h.percentile_ns(0.99) << ", \"max\": " << h.max_ns() << '}';
+    }
+    out << "}}";
+    sep = ",\n";
+  }
+  out << "\n]}\n";
+  LOG("wrote stats for %zu modules to %s", luna_ctxs_.size(), path.generic_string().c_str());
+}
+
+void Luna::bench_command(std::string_view sv) {
+  if (!sv.starts_with("data")) {
+    print_help();
+    return;
+  }
+  sv.remove_prefix(4);
+  sv.remove_prefix(std::min(sv.find_first_not_of(" "), sv.size()));
+  lua_Integer rounds = 1000;
+  if (!sv.empty() && (std::from_chars(sv.data(), sv.data() + sv.size(), rounds).ec != std::errc{} || rounds <= 0)) {
+    LOG("bench rounds must be a positive number.");
+    return;
+  }
+  lua_State* l = luaL_newstate();
+  // not a module's state, nothing is counted for it.
+  *static_cast<LunaContext**>(lua_getextraspace(l)) = nullptr;
+  luaL_openlibs(l);
+  luaL_requiref(l, "luna", open_luna, 1);
+  lua_pop(l, 1);
+  if (luaL_loadstring(l, data_bench_chunk) != LUA_OK) {
+    LOG("bench failed to load: %s", lua_tostring(l, -1));
+    lua_close(l);
+    return;
+  }
+  constexpr auto num_exprs = sizeof(data_bench_exprs) / sizeof(data_bench_exprs[0]);
+  lua_createtable(l, num_exprs, 0);
+  for (auto i = 0u; i < num_exprs; ++i) {
+    lua_pushstring(l, data_bench_exprs[i]);
+    lua_rawseti(l, -2, i + 1);
+  }
+  lua_pushinteger(l, rounds);
+  // the cache would turn both loops into lookups.
+  bool cache_data = std::exchange(config_.cache_data, false);
+  auto status = lua_pcall(l, 2, 2, 0);
+  config_.cache_data = cache_data;
+  if (status != LUA_OK) {
+    LOG("bench failed: %s", lua_tostring(l, -1));
+  } else {
+    auto reads = double(rounds) * num_exprs;
+    auto single = lua_tonumber(l, -2);
+    auto batched = lua_tonumber(l, -1);
+    LOG("%lld rounds of %zu reads", (long long)rounds, num_exprs);
+    LOG("  luna.data:       %.3fs, %.0f ns/read", single, single * 1e9 / reads);
+    LOG("  luna.data_batch: %.3fs, %.0f ns/read", batched, batched * 1e9 / reads);
+  }
+  lua_close(l);
+}
+
+void Luna::write_profile(LunaContext& ctx) {
+  auto samples = ctx.stop_profile();
+  auto dir = modules_dir / "profiles";
+  std::error_code ec;
+  fs::create_directories(dir, ec);
+  auto path = dir / (ctx.name + ".folded");
+  std::ofstream out{path, std::ios::trunc};
+  if (!out) {
+    LOG("unable to write profile to %s", path.generic_string().c_str());
+    return;
+  }
+  std::uint64_t total = 0;
+  for (auto&& [stack, count] : samples) {
+    out << stack << ' ' << count << '\n';
+    total += count;
+  }
+  LOG("wrote %llu samples for %s to %s", (unsigned long long)total, ctx.name.c_str(), path.generic_string().c_str());
 }
 
 int Luna::find_index_of(std::string_view ctx_name) {
@@ -301,32 +1124,120 @@ void Luna::load_config() {
   luaL_openlibs(l);
   if (luaL_dofile(l, str_path.c_str()) != 0) {
     LOG("error loading Luna config file: %s", lua_tostring(l, -1));
+    lua_close(l);
     return;
   }
   if (lua_getglobal(l, "debug") == LUA_TBOOLEAN) {
     debug_ = lua_toboolean(l, -1);
   }
+  lua_pop(l, 1);
+  if (lua_getglobal(l, "state_pool_size") == LUA_TNUMBER) {
+    config_.state_pool_size = config_integer(l, "state_pool_size", 0, 16);
+  }
+  lua_pop(l, 1);
+  if (lua_getglobal(l, "event_queue_size") == LUA_TNUMBER) {
+    config_.event_queue_size = config_integer(l, "event_queue_size", 1, 1 << 20);
+  }
+  lua_pop(l, 1);
+  if (lua_getglobal(l, "event_queue_overflow") == LUA_TSTRING) {
+    std::string_view policy = lua_tostring(l, -1);
+    if (policy == "drop_oldest") {
+      config_.event_queue_overflow = EventQueue::Overflow::DropOldest;
+    } else if (policy == "drop_newest") {
+      config_.event_queue_overflow = EventQueue::Overflow::DropNewest;
+    } else if (policy == "grow") {
+      config_.event_queue_overflow = EventQueue::Overflow::Grow;
+    } else {
+      LOG("unknown event_queue_overflow '%s', keeping drop_oldest.", policy.data());
+    }
+  }
+  lua_pop(l, 1);
+  if (lua_getglobal(l, "async_workers") == LUA_TNUMBER) {
+    config_.async_workers = config_integer(l, "async_workers", 0, 64);
+  }
+  lua_pop(l, 1);
+  if (lua_getglobal(l, "async_memory_limit_kb") == LUA_TNUMBER) {
+    config_.async_memory_limit_kb = config_integer(l, "async_memory_limit_kb", 0, max_memory_limit_kb);
+  }
+  lua_pop(l, 1);
+  if (lua_getglobal(l, "chat_lines_per_frame") == LUA_TNUMBER) {
+    config_.chat_lines_per_frame = config_integer(l, "chat_lines_per_frame", 0, 1 << 20);
+  }
+  lua_pop(l, 1);
+  if (lua_getglobal(l, "frame_budget_us") == LUA_TNUMBER) {
+    config_.frame_budget_us = config_integer(l, "frame_budget_us", 0, 1000000);
+  }
+  lua_pop(l, 1);
+  if (lua_getglobal(l, "max_deferred_frames") == LUA_TNUMBER) {
+    config_.max_deferred_frames = std::uint32_t(config_integer(l, "max_deferred_frames", 0, 10000));
+  }
+  lua_pop(l, 1);
+  if (lua_getglobal(l, "gc_step_kb") == LUA_TNUMBER) {
+    config_.gc_step_kb = config_integer(l, "gc_step_kb", 1, 1 << 16);
+  }
+  lua_pop(l, 1);
+  if (lua_getglobal(l, "cache_data") == LUA_TBOOLEAN) {
+    config_.cache_data = lua_toboolean(l, -1);
+  }
+  lua_pop(l, 1);
+  if (lua_getglobal(l, "autostart") == LUA_TTABLE) {
+    for (lua_Integer i = 1; lua_rawgeti(l, -1, i) == LUA_TSTRING; ++i) {
+      config_.autostart.emplace_back(lua_tostring(l, -1));
+      lua_pop(l, 1);
+    }
+    lua_pop(l, 1);
+  }
+  lua_pop(l, 1);
+  lua_pushglobaltable(l);
+  read_module_config(l, -1, config_.defaults);
+  lua_pop(l, 1);
+  if (lua_getglobal(l, "modules") == LUA_TTABLE) {
+    lua_pushnil(l);
+    while (lua_next(l, -2) != 0) {
+      if (lua_type(l, -2) == LUA_TSTRING && lua_istable(l, -1)) {
+        ModuleConfig conf = config_.defaults;
+        read_module_config(l, -1, conf);
+        config_.modules[lua_tostring(l, -2)] = conf;
+      }
+      lua_pop(l, 1);
+    }
+  }
+  lua_pop(l, 1);
   lua_close(l);
 }
 
 void Luna::save_config() {}
 
 int Luna::add_bind(lua_State* ls) {
-  auto cmd = luaL_checkstring(ls, 2);
-  if (cmd == nullptr) {
+  size_t len = 0;
+  auto cmd = luaL_checklstring(ls, 2, &len);
+  if (bind_router_.find({cmd, len}) != nullptr) {
+    return luaL_error(ls, "conflicting bind %s already exists", cmd);
+  }
+  auto ctx = zx::get_context(ls);
+  if (ctx == nullptr) {
     return 0;
   }
-  // hackery, check if the command is already bound by something else.
-  for (const auto& ctx : luna_ctxs_) {
-    if (ctx->has_command_binding(cmd)) {
-      return luaL_error(ls, "conflicting bind %s already exists", cmd);
-    }
+  int key = ctx->add_command_binding(ls);
+  if (key == LUA_NOREF) {
+    return 0;
   }
+  bind_router_.add({cmd, len}, ctx, key);
+  return 0;
+}
+
+int Luna::add_event(lua_State* ls) {
   auto ctx = zx::get_context(ls);
   if (ctx == nullptr) {
     return 0;
   }
-  ctx->add_command_binding(ls);
+  int key = ctx->add_event_binding(ls);
+  if (key == LUA_NOREF) {
+    return 0;
+  }
+  size_t len = 0;
+  const char* event_str = lua_tolstring(ls, 2, &len);
+  event_matcher_.add(ctx, key, std::string_view{event_str, len});
   return 0;
 }
 
@@ -336,9 +1247,144 @@ void Luna::cleanup_exiting_contexts() {
     if (!ctx->exiting) {
       continue;
     }
+    unregister_context(ctx.get());
     luna_ctxs_.erase(luna_ctxs_.begin() + i);
     --i;
   }
 }
 
+PreparedState Luna::take_prepared_state() {
+  if (state_pool_.empty()) {
+    return LunaContext::prepare_state(open_luna, bytecode_cache_);
+  }
+  PreparedState state = std::move(state_pool_.back());
+  state_pool_.pop_back();
+  return state;
+}
+
+void Luna::refill_state_pool(std::chrono::steady_clock::time_point frame_start) {
+  // one per pulse, so a burst of /luna run doesn't turn into a burst of state creation later, and only in
+  // frames with budget left, building a state is the cost /luna run is spared.
+  if (state_pool_.size() < config_.state_pool_size && !over_budget(frame_start)) {
+    state_pool_.push_back(LunaContext::prepare_state(open_luna, bytecode_cache_));
+  }
+}
+
+void Luna::schedule_pulse(LunaContext* ctx, std::chrono::steady_clock::time_point wake) {
+  if (!ctx->wants_pulse()) {
+    return;
+  }
+  pulse_heap_.push_back({.wake = wake, .ctx = ctx, .gen = ++ctx->schedule_gen});
+  std::push_heap(pulse_heap_.begin(), pulse_heap_.end(), wakes_later);
+}
+
+LunaContext* Luna::find_context(std::uint32_t id) {
+  auto it = std::find_if(luna_ctxs_.begin(), luna_ctxs_.end(),
+                         [id](const std::unique_ptr<LunaContext>& ctx) { return ctx->id == id; });
+  return it != luna_ctxs_.end() ? it->get() : nullptr;
+}
+
+void Luna::deliver_async_results() {
+  // results for modules that have been stopped since are dropped.
+  workers_.drain(async_results_);
+  for (WorkerPool::Result& result : async_results_) {
+    if (result.kind == WorkerPool::Kind::Compile) {
+      for (PendingRun& pending : pending_runs_) {
+        if (pending.job_id == result.job_id) {
+          pending.compiled = true;
+          pending.chunks = std::move(result.chunks);
+        }
+      }
+      continue;
+    }
+    if (auto ctx = find_context(result.ctx_id)) {
+      ctx->complete_async(result);
+      reschedule_if_needed(ctx);
+    }
+  }
+  file_io_.drain(file_results_);
+  for (const FileIo::Result& result : file_results_) {
+    if (auto ctx = find_context(result.ctx_id)) {
+      ctx->complete_file(result);
+      reschedule_if_needed(ctx);
+    }
+  }
+}
+
+void Luna::step_collectors(std::chrono::steady_clock::time_point frame_start) {
+  if (config_.frame_budget_us == 0 || config_.gc_step_kb == 0 || luna_ctxs_.empty()) {
+    return;
+  }
+  auto deadline = frame_start + std::chrono::microseconds(config_.frame_budget_us);
+  if (std::chrono::steady_clock::now() >= deadline) {
+    return;
+  }
+  // modules that won't run next frame first, a step there can't land in the middle of their work. Each frame
+  // starts one module further along so the same one isn't always first.
+  gc_idle_.clear();
+  gc_busy_.clear();
+  auto n = luna_ctxs_.size();
+  gc_cursor_ = (gc_cursor_ + 1) % n;
+  for (auto i = 0u; i < n; ++i) {
+    LunaContext* ctx = luna_ctxs_[(gc_cursor_ + i) % n].get();
+    if (ctx->exiting) {
+      continue;
+    }
+    bool idle = ctx->paused || ctx->next_wake(frame_time_) > frame_time_;
+    (idle ? gc_idle_ : gc_busy_).push_back(ctx);
+  }
+  auto slack = config_.gc_step_kb * 1024;
+  int step_kb = int(config_.gc_step_kb);
+  for (auto group : {&gc_idle_, &gc_busy_}) {
+    for (LunaContext* ctx : *group) {
+      while (ctx->gc_wanted(slack)) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+          return;
+        }
+        if (ctx->gc_step(step_kb)) {
+          break;
+        }
+      }
+    }
+  }
+}
+
+void Luna::reschedule_if_needed(LunaContext* ctx) {
+  if (ctx->reschedule) {
+    ctx->reschedule = false;
+    schedule_pulse(ctx, ctx->next_wake(frame_time_));
+  }
+}
+
+// the entry stays in the heap until it reaches the top, it's just marked stale.
+void Luna::unschedule_pulse(LunaContext* ctx) { ++ctx->schedule_gen; }
+
+void Luna::pop_due_pulses(std::chrono::steady_clock::time_point now) {
+  due_pulses_.clear();
+  while (!pulse_heap_.empty() && pulse_heap_.front().wake <= now) {
+    std::pop_heap(pulse_heap_.begin(), pulse_heap_.end(), wakes_later);
+    ScheduledPulse entry = pulse_heap_.back();
+    pulse_heap_.pop_back();
+    if (entry.gen == entry.ctx->schedule_gen && entry.ctx->wants_pulse()) {
+      due_pulses_.push_back(entry.ctx);
+    }
+  }
+}
+
+void Luna::unregister_context(LunaContext* ctx) {
+  if (ctx->profiling()) {
+    write_profile(*ctx);
+  }
+  event_matcher_.remove_context(ctx);
+  bind_router_.remove_context(ctx);
+  handler_queue_.remove_context(ctx);
+  // stale entries still point at the context, so they have to go before it's destroyed.
+  auto it = std::remove_if(pulse_heap_.begin(), pulse_heap_.end(),
+                           [ctx](const ScheduledPulse& entry) { return entry.ctx == ctx; });
+  if (it != pulse_heap_.end()) {
+    pulse_heap_.erase(it, pulse_heap_.end());
+    std::make_heap(pulse_heap_.begin(), pulse_heap_.end(), wakes_later);
+  }
+}
+
 Luna* luna;
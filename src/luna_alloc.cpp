@@ -0,0 +1,132 @@
+/*
+ * luna_alloc.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#include "luna_alloc.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+LunaAllocator::~LunaAllocator() {
+  for (void* chunk : chunks_) {
+    std::free(chunk);
+  }
+}
+
+void* LunaAllocator::alloc(void* ud, void* ptr, std::size_t osize, std::size_t nsize) {
+  auto self = static_cast<LunaAllocator*>(ud);
+  // for new blocks osize is the type of the object being created, not a size.
+  if (ptr == nullptr) {
+    osize = 0;
+  }
+  if (nsize == 0) {
+    if (ptr != nullptr) {
+      self->release(ptr, osize);
+    }
+    return nullptr;
+  }
+  if (nsize > osize && self->armed_ && self->limit_ != 0 && self->current_ - osize + nsize > self->limit_) {
+    // lua runs an emergency collection and retries before raising a memory error.
+    ++self->refusals_;
+    return nullptr;
+  }
+  if (ptr == nullptr) {
+    return self->allocate(nsize);
+  }
+  return self->reallocate(ptr, osize, nsize);
+}
+
+LunaAllocator::Stats LunaAllocator::stats() const {
+  return {
+      .current_bytes = current_,
+      .peak_bytes = peak_,
+      .chunk_bytes = chunks_.size() * chunk_size,
+      .allocations = allocations_,
+      .frees = frees_,
+      .refusals = refusals_,
+  };
+}
+
+void* LunaAllocator::carve(std::size_t cls) {
+  std::size_t size = (cls + 1) * granularity;
+  if (chunk_cur_ == nullptr || std::size_t(chunk_end_ - chunk_cur_) < size) {
+    // whatever is left of the old chunk is too small for this class and is abandoned.
+    auto chunk = static_cast<char*>(std::malloc(chunk_size));
+    if (chunk == nullptr) {
+      return nullptr;
+    }
+    chunks_.push_back(chunk);
+    chunk_cur_ = chunk;
+    chunk_end_ = chunk + chunk_size;
+  }
+  void* p = chunk_cur_;
+  chunk_cur_ += size;
+  return p;
+}
+
+void* LunaAllocator::allocate(std::size_t n) {
+  void* p = nullptr;
+  if (n <= max_small) {
+    auto cls = class_of(n);
+    if (free_lists_[cls] != nullptr) {
+      FreeBlock* block = free_lists_[cls];
+      free_lists_[cls] = block->next;
+      p = block;
+    } else {
+      p = carve(cls);
+    }
+  } else {
+    p = std::malloc(n);
+  }
+  if (p == nullptr) {
+    return nullptr;
+  }
+  ++allocations_;
+  current_ += n;
+  peak_ = std::max(peak_, current_);
+  return p;
+}
+
+void LunaAllocator::release(void* p, std::size_t n) {
+  ++frees_;
+  current_ -= n;
+  if (n <= max_small) {
+    auto block = static_cast<FreeBlock*>(p);
+    auto cls = class_of(n);
+    block->next = free_lists_[cls];
+    free_lists_[cls] = block;
+    return;
+  }
+  std::free(p);
+}
+
+void* LunaAllocator::reallocate(void* p, std::size_t osize, std::size_t nsize) {
+  bool old_small = osize <= max_small;
+  bool new_small = nsize <= max_small;
+  if (old_small && new_small && class_of(osize) == class_of(nsize)) {
+    current_ = current_ - osize + nsize;
+    peak_ = std::max(peak_, current_);
+    return p;
+  }
+  if (!old_small && !new_small) {
+    void* q = std::realloc(p, nsize);
+    if (q == nullptr) {
+      return nullptr;
+    }
+    current_ = current_ - osize + nsize;
+    peak_ = std::max(peak_, current_);
+    return q;
+  }
+  // moving between the pools and the system heap.
+  void* q = allocate(nsize);
+  if (q == nullptr) {
+    return nullptr;
+  }
+  std::memcpy(q, p, std::min(osize, nsize));
+  release(p, osize);
+  return q;
+}
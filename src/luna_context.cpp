@@ -6,10 +6,33 @@
  */
 
 #include "luna_context.hpp"
+#include "bytecode_cache.hpp"
 #include "luna.hpp"
 #include "mq2_api.hpp"
+#include "value_codec.hpp"
+
+#include <cstring>
+#include <utility>
 
 namespace {
+// budgets and the watchdog are checked every this many VM instructions.
+constexpr int hook_period = 1000;
+// the profiler takes a sample every this many hook calls.
+constexpr int profile_every = 10;
+constexpr int profile_max_depth = 64;
+// coroutines kept for reuse once their handler finished, beyond that they're left to the GC.
+constexpr std::size_t max_idle_threads = 8;
+
+constexpr const char* spawned_kind = "task";
+constexpr const char* gc_sentinel_meta = "luna.GcSentinel";
+
+bool wakes_later(const TaskWake& a, const TaskWake& b) { return a.wake > b.wake; }
+
+int append_chunk(lua_State*, const void* p, size_t sz, void* ud) {
+  static_cast<std::string*>(ud)->append(static_cast<const char*>(p), sz);
+  return 0;
+}
+
 int get_key(lua_State* l, int idx, const char* field_name) {
   if (lua_getfield(l, idx, field_name) == LUA_TFUNCTION) {
     return luaL_ref(l, LUA_REGISTRYINDEX);
@@ -18,6 +41,12 @@ int get_key(lua_State* l, int idx, const char* field_name) {
   return LUA_NOREF;
 }
 
+// only reachable if something allocates outside a protected call, Lua aborts once this returns.
+int panic(lua_State* ls) {
+  LOG("\arunprotected error in lua: %s", lua_tostring(ls, -1));
+  return 0;
+}
+
 EventKeys get_event_keys(lua_State* main_state) {
   auto ret = lua_getglobal(main_state, module_global);
   if (ret != LUA_TTABLE) {
@@ -42,9 +71,42 @@ EventKeys get_event_keys(lua_State* main_state) {
 }
 } // namespace
 
-LunaContext::LunaContext(const std::string& name) : name{name} {
-  threads_.main = luaL_newstate();
-  luaL_openlibs(threads_.main);
+PreparedState::~PreparedState() {
+  if (main != nullptr) {
+    lua_close(main);
+  }
+}
+
+PreparedState::PreparedState(PreparedState&& other) noexcept
+    : allocator{std::move(other.allocator)}, main{std::exchange(other.main, nullptr)} {}
+
+PreparedState& PreparedState::operator=(PreparedState&& other) noexcept {
+  if (this != &other) {
+    if (main != nullptr) {
+      lua_close(main);
+    }
+    main = std::exchange(other.main, nullptr);
+    allocator = std::move(other.allocator);
+  }
+  return *this;
+}
+
+PreparedState LunaContext::prepare_state(lua_CFunction open_luna, BytecodeCache& cache) {
+  PreparedState state;
+  state.allocator = std::make_unique<LunaAllocator>();
+  state.main = lua_newstate(LunaAllocator::alloc, state.allocator.get());
+  *static_cast<LunaContext**>(lua_getextraspace(state.main)) = nullptr;
+  lua_atpanic(state.main, panic);
+  luaL_openlibs(state.main);
+  cache.install_searcher(state.main);
+  luaL_requiref(state.main, "luna", open_luna, 1);
+  lua_pop(state.main, 1);
+  return state;
+}
+
+LunaContext::LunaContext(const std::string& name, PreparedState state)
+    : name{name}, allocator_{std::move(state.allocator)} {
+  threads_.main = std::exchange(state.main, nullptr);
 
   lua_pushstring(threads_.main, LUNA_MODULE_KEY);
   lua_pushstring(threads_.main, name.c_str());
@@ -53,13 +115,18 @@ LunaContext::LunaContext(const std::string& name) : name{name} {
   lua_pushstring(threads_.main, LUNA_CTX_PTR_KEY);
   lua_pushlightuserdata(threads_.main, this);
   lua_rawset(threads_.main, LUA_REGISTRYINDEX);
+  // threads copy the extra space of the main thread, this lets hooks find the context cheaply.
+  *static_cast<LunaContext**>(lua_getextraspace(threads_.main)) = this;
 
   threads_.pulse = lua_newthread(threads_.main);
   threads_.event = lua_newthread(threads_.main);
   threads_.bind = lua_newthread(threads_.main);
+  install_gc_sentinel();
 }
 
 LunaContext::~LunaContext() {
+  // let at_exit run even if the module is being stopped for hitting its memory limit.
+  allocator_->set_limit(0);
   exit_fn();
   threads_.pulse = nullptr;
   threads_.event = nullptr;
@@ -102,29 +169,29 @@ const char* LunaContext::get_context_name(lua_State* ls) {
   return module_name;
 }
 
-void LunaContext::add_command_binding(lua_State* ls) {
+int LunaContext::add_command_binding(lua_State* ls) {
   if (!lua_isfunction(ls, 1)) {
     luaL_checktype(ls, 2, LUA_TFUNCTION);
-    return;
+    return LUA_NOREF;
   }
   auto cmd = luaL_checkstring(ls, 2);
   if (cmd == nullptr) {
-    return;
+    return LUA_NOREF;
   }
   DLOG("attempting to add bind command %s", cmd);
   std::string_view sv{cmd};
   if (sv.size() <= 3) {
     luaL_error(ls, "bind command provided was too short.");
-    return;
+    return LUA_NOREF;
   }
   if (!isalpha(sv[0])) {
     luaL_error(ls, "first character of bind command must be a-Z");
-    return;
+    return LUA_NOREF;
   }
   for (char c : sv) {
     if (!isalnum(c) && c != '_') {
       luaL_error(ls, "bind command name may only contain a-Z,0-9,_");
-      return;
+      return LUA_NOREF;
     }
   }
 
@@ -133,144 +200,536 @@ void LunaContext::add_command_binding(lua_State* ls) {
   // place the function in the registry
   if (!lua_isfunction(ls, -1)) {
     LOG("stack error in add_command_binding!");
-    return;
+    return LUA_NOREF;
   }
-  auto key = luaL_ref(ls, LUA_REGISTRYINDEX);
-  bound_command_map_[std::string{sv}] = key;
   DLOG("added bind command %s", cmd);
-  return;
+  // the command is routed to it by Luna's BindRouter.
+  return luaL_ref(ls, LUA_REGISTRYINDEX);
 }
 
-void LunaContext::add_event_binding(lua_State* ls) {
+int LunaContext::add_event_binding(lua_State* ls) {
   if (!lua_isfunction(ls, 1)) {
     luaL_checktype(ls, 1, LUA_TFUNCTION);
-    return;
+    return LUA_NOREF;
   }
   auto event_str = luaL_checkstring(ls, 2);
   if (event_str == nullptr) {
-    return;
+    return LUA_NOREF;
   }
   std::string_view event_sv{event_str};
   bool needs_interp = false;
   if (event_sv.find("$[") != std::string_view::npos) {
     // TODO
     luaL_error(ls, "MQ data interpreter for event strings is NYI.");
-    return;
+    return LUA_NOREF;
   }
   // makes sure the function is at the top of the stack
   lua_pushvalue(ls, 1);
   // place the function in the registry
   if (!lua_isfunction(ls, -1)) {
     LOG("stack error in add_event_bindind!");
-    return;
+    return LUA_NOREF;
   }
 
   DLOG("adding event |%s|", event_str);
   if (needs_interp) {
     // TODO
     luaL_error(ls, "MQ data interpreter for event strings is NYI.");
-    return;
+    return LUA_NOREF;
+  }
+  // the pattern itself is compiled by Luna's EventMatcher.
+  return luaL_ref(ls, LUA_REGISTRYINDEX);
+}
+
+template <typename Push>
+int LunaContext::push_protected(lua_State* thread, Push& push) {
+  if (!lua_checkstack(thread, 2)) {
+    return -1;
+  }
+  int top = lua_gettop(thread);
+  lua_pushcfunction(thread, [](lua_State* l) {
+    auto& fn = *static_cast<Push*>(lua_touserdata(l, 1));
+    lua_settop(l, 0);
+    return fn(l);
+  });
+  lua_pushlightuserdata(thread, &push);
+  auto armed = arm_memory_limit();
+  if (lua_pcall(thread, 1, LUA_MULTRET, 0) != LUA_OK) {
+    lua_settop(thread, top);
+    return -1;
+  }
+  return lua_gettop(thread) - top;
+}
+
+PooledThread LunaContext::acquire_thread() {
+  PooledThread co;
+  if (!idle_threads_.empty()) {
+    co = idle_threads_.back();
+    idle_threads_.pop_back();
   } else {
-    event_regexes_.emplace_back(std::regex{std::string{event_sv}});
+    // on the main thread, which is never suspended, even when a task running on another one asked for it.
+    auto create = [&co](lua_State* l) {
+      co.thread = lua_newthread(l);
+      co.ref = luaL_ref(l, LUA_REGISTRYINDEX);
+      return 0;
+    };
+    if (push_protected(threads_.main, create) < 0) {
+      return {};
+    }
   }
-  auto key = luaL_ref(ls, LUA_REGISTRYINDEX);
-  event_fn_keys_.push_back(key);
+  lua_sethook(co.thread, hook_handlers() ? count_hook : nullptr, hook_handlers() ? LUA_MASKCOUNT : 0, hook_period);
+  return co;
 }
 
-bool LunaContext::has_command_binding(std::string_view command) const { return bound_command_map_.contains(command); }
+void LunaContext::release_thread(PooledThread co) {
+  // closes pending to-be-closed variables and empties the stack, so the thread can run a new function.
+  lua_resetthread(co.thread);
+  if (idle_threads_.size() < max_idle_threads) {
+    idle_threads_.push_back(co);
+  } else {
+    luaL_unref(threads_.main, LUA_REGISTRYINDEX, co.ref);
+  }
+}
+
+void LunaContext::report_error(lua_State* thread, const char* kind, int status) {
+  if (status == LUA_ERRMEM) {
+    out_of_memory();
+  }
+  const char* msg = lua_tostring(thread, -1);
+  LOG("\ar%s handler in %s had an error!", kind, name.c_str());
+  if (msg != nullptr) {
+    LOG("  \arerror message: %s", msg);
+  }
+  lua_pop(thread, 1);
+}
 
-void LunaContext::do_command_bind(std::vector<std::string_view> args) {
+template <typename PushArgs>
+void LunaContext::run_handler(int fn_key, const char* kind, lua_State* shared, PushArgs push_args) {
   if (exiting) {
     return;
   }
-  auto cmd = args[0];
-  auto it = bound_command_map_.find(cmd);
-  if (it == bound_command_map_.end()) {
-    LOG("1:ERROR in do_command_bind, please report.");
+  handler_instructions_ = 0;
+  if (suspended_handlers_ >= max_suspended_handlers) {
+    if (lua_rawgeti(shared, LUA_REGISTRYINDEX, fn_key) != LUA_TFUNCTION) {
+      LOG("ERROR: can't find %s function for key %d.", kind, fn_key);
+      lua_pop(shared, 1);
+      return;
+    }
+    int nargs = push_protected(shared, push_args);
+    if (nargs < 0) {
+      lua_pop(shared, 1);
+      out_of_memory();
+      return;
+    }
+    auto status = [&] {
+      auto armed = arm_memory_limit();
+      return lua_pcall(shared, nargs, 0, 0);
+    }();
+    if (status != LUA_OK) {
+      report_error(shared, kind, status);
+    }
     return;
   }
-  int registry_key = it->second;
-  if (registry_key == LUA_NOREF) {
-    LOG("2:ERROR in do_command_bind, please report.");
+  PooledThread co = acquire_thread();
+  if (co.thread == nullptr) {
+    out_of_memory();
     return;
   }
-  auto type = lua_rawgeti(threads_.bind, LUA_REGISTRYINDEX, registry_key);
-  if (type != LUA_TFUNCTION) {
-    // create temp allocation for error string
-    std::string cmd_name{cmd};
-    LOG("ERROR: can't find bind function for command %s.", cmd_name.c_str());
-    lua_pop(threads_.bind, 1);
+  if (lua_rawgeti(co.thread, LUA_REGISTRYINDEX, fn_key) != LUA_TFUNCTION) {
+    LOG("ERROR: can't find %s function for key %d.", kind, fn_key);
+    lua_pop(co.thread, 1);
+    release_thread(co);
     return;
   }
-  char buf[2048] = {'\0'};
-  // push the args for the function onto the stack
-  int nargs = 0;
-  for (auto l = 1u; l < args.size(); ++l) {
-    auto&& arg = args[l];
-    if (arg.size() == 0 || arg == " ") {
-      continue;
+  int nargs = push_protected(co.thread, push_args);
+  if (nargs < 0) {
+    release_thread(co);
+    out_of_memory();
+    return;
+  }
+  auto id = ++last_task_id_;
+  Task& task = tasks_[id];
+  task.co = co;
+  task.kind = kind;
+  task.id = id;
+  ++suspended_handlers_;
+  resume_task(task, nargs);
+}
+
+void LunaContext::resume_task(Task& task, int nargs) {
+  // a bare luna.yield() continues on the next pulse.
+  task.wake = luna->frame_time();
+  handler_instructions_ = 0;
+  running_task_ = &task;
+  int nres = 0;
+  ++stats.resumes;
+  auto start = std::chrono::steady_clock::now();
+  auto status = [&] {
+    auto armed = arm_memory_limit();
+    return lua_resume(task.co.thread, nullptr, nargs, &nres);
+  }();
+  task.cpu_time += std::chrono::steady_clock::now() - start;
+  running_task_ = nullptr;
+  if (status == LUA_YIELD && !task.cancelled) {
+    lua_pop(task.co.thread, nres);
+    // tasks waiting on luna.async or luna.fs are resumed by complete_waiter instead.
+    if (task.wake != std::chrono::steady_clock::time_point::max()) {
+      task_heap_.push_back({.wake = task.wake, .id = task.id});
+      std::push_heap(task_heap_.begin(), task_heap_.end(), wakes_later);
+      reschedule = true;
     }
-    std::strncpy(buf, arg.data(), arg.size());
-    buf[arg.size()] = '\0';
-    lua_pushstring(threads_.bind, buf);
-    ++nargs;
-  }
-  if (lua_pcall(threads_.bind, nargs, 0, 0) != LUA_OK) {
-    const char* event_msg = lua_tostring(threads_.bind, -1);
-    LOG("\ardo_command_bind had an error!");
-    if (event_msg != nullptr) {
-      LOG("  \arerror message: %s", event_msg);
-      lua_pop(threads_.bind, 1);
+    return;
+  }
+  if (status != LUA_OK && status != LUA_YIELD) {
+    report_error(task.co.thread, task.kind, status);
+  }
+  end_task(task);
+}
+
+void LunaContext::end_task(Task& task) {
+  if (task.kind != spawned_kind) {
+    --suspended_handlers_;
+  }
+  PooledThread co = task.co;
+  tasks_.erase(task.id);
+  release_thread(co);
+}
+
+void LunaContext::resume_due_tasks(std::chrono::steady_clock::time_point now) {
+  // collected first, a task that yields again without sleeping waits for the next pulse.
+  due_tasks_.clear();
+  while (!task_heap_.empty() && task_heap_.front().wake <= now) {
+    std::pop_heap(task_heap_.begin(), task_heap_.end(), wakes_later);
+    due_tasks_.push_back(task_heap_.back());
+    task_heap_.pop_back();
+  }
+  for (const TaskWake& entry : due_tasks_) {
+    if (exiting) {
+      return;
+    }
+    // an earlier task may have cancelled this one.
+    auto it = tasks_.find(entry.id);
+    if (it != tasks_.end()) {
+      resume_task(it->second, std::exchange(it->second.start_args, 0));
     }
   }
 }
 
-void LunaContext::do_event(const std::string& event_line) {
-  if (exiting) {
-    return;
+int LunaContext::spawn(lua_State* ls) {
+  luaL_checktype(ls, 1, LUA_TFUNCTION);
+  int nargs = lua_gettop(ls);
+  lua_Debug ar;
+  lua_pushvalue(ls, 1);
+  lua_getinfo(ls, ">S", &ar);
+  PooledThread co = acquire_thread();
+  if (co.thread == nullptr) {
+    return luaL_error(ls, "not enough memory to start a task");
+  }
+  if (!lua_checkstack(co.thread, nargs)) {
+    release_thread(co);
+    return luaL_error(ls, "too many arguments to luna.spawn");
+  }
+  // the function and its arguments, they're passed on the first resume.
+  lua_xmove(ls, co.thread, nargs);
+  auto id = ++last_task_id_;
+  Task& task = tasks_[id];
+  task.co = co;
+  task.kind = spawned_kind;
+  task.id = id;
+  task.start_args = nargs - 1;
+  task.wake = luna->frame_time();
+  char source[128];
+  std::snprintf(source, sizeof(source), "%s:%d", ar.short_src, ar.linedefined);
+  task.source = source;
+  task_heap_.push_back({.wake = task.wake, .id = id});
+  std::push_heap(task_heap_.begin(), task_heap_.end(), wakes_later);
+  reschedule = true;
+  lua_pushinteger(ls, id);
+  return 1;
+}
+
+int LunaContext::cancel(lua_State* ls) {
+  auto it = tasks_.find(std::uint32_t(luaL_checkinteger(ls, 1)));
+  if (it == tasks_.end() || it->second.cancelled) {
+    lua_pushboolean(ls, false);
+    return 1;
+  }
+  Task& task = it->second;
+  if (&task == running_task_) {
+    // a task cancelling itself is ended once it yields or returns.
+    task.cancelled = true;
+  } else {
+    // its heap entry goes stale and is dropped when it surfaces.
+    end_task(task);
   }
-  std::smatch sm;
-  for (auto i = 0u; i < event_regexes_.size(); ++i) {
-    auto&& re = event_regexes_[i];
-    if (!std::regex_match(event_line, sm, re)) {
-      continue;
+  lua_pushboolean(ls, true);
+  return 1;
+}
+
+int LunaContext::async(lua_State* ls, WorkerPool& pool) {
+  std::string chunk;
+  bool binary = lua_type(ls, 1) == LUA_TFUNCTION;
+  if (binary) {
+    // only _ENV can be an upvalue, it's replaced by the job's own environment.
+    const char* upvalue;
+    for (int i = 1; (upvalue = lua_getupvalue(ls, 1, i)) != nullptr; ++i) {
+      lua_pop(ls, 1);
+      if (i > 1 || std::strcmp(upvalue, "_ENV") != 0) {
+        return luaL_argerror(ls, 1, "async functions can't use upvalues (locals from an enclosing scope)");
+      }
     }
-    int nargs = sm.size() - 1;
-    // push the event handler function onto the stack.
-    auto registry_key = event_fn_keys_[i];
-    auto type = lua_rawgeti(threads_.event, LUA_REGISTRYINDEX, registry_key);
-    if (type != LUA_TFUNCTION) {
-      // TODO: error handling if fn not found
-      lua_pop(threads_.event, 1);
-      continue;
+    lua_pushvalue(ls, 1);
+    if (lua_dump(ls, append_chunk, &chunk, 0) != 0) {
+      return luaL_argerror(ls, 1, "C functions can't be run async");
     }
-    // 0 = full match string
-    for (auto l = 1u; l < sm.size(); ++l) {
-      auto match_len = sm.length(l);
-      auto match_offset = sm.position(l);
-      lua_pushlstring(threads_.event, event_line.data() + match_offset, match_len);
+    lua_pop(ls, 1);
+  } else {
+    size_t len;
+    const char* source = luaL_checklstring(ls, 1, &len);
+    chunk.assign(source, len);
+  }
+  std::string args;
+  std::string error;
+  if (lua_isnoneornil(ls, 2)) {
+    zx::encode_values(ls, 1, 0, args, error);
+  } else {
+    luaL_checktype(ls, 2, LUA_TTABLE);
+    int n = int(luaL_len(ls, 2));
+    luaL_checkstack(ls, n, "too many async arguments");
+    for (int i = 1; i <= n; ++i) {
+      lua_rawgeti(ls, 2, i);
     }
-    if (lua_pcall(threads_.event, nargs, 0, 0) != LUA_OK) {
-      const char* event_msg = lua_tostring(threads_.event, -1);
-      LOG("event matching |%s| had an error.", event_line.c_str());
-      if (event_msg != nullptr) {
-        LOG("  \arerror message: %s", event_msg);
-        lua_pop(threads_.event, 1);
-      }
+    bool encoded = zx::encode_values(ls, -n, n, args, error);
+    lua_pop(ls, n);
+    if (!encoded) {
+      return luaL_error(ls, "luna.async arguments: %s", error.c_str());
     }
   }
+  Waiter waiter = make_waiter(ls, 3, "luna.async");
+  auto job_id = pool.submit(id, std::move(chunk), binary, std::move(args));
+  return await(ls, async_waiters_, job_id, waiter);
 }
 
-bool LunaContext::matches_event(const char* event_line) const {
-  for (const std::regex& re : event_regexes_) {
-    if (std::regex_match(event_line, re)) {
-      return true;
+void LunaContext::complete_async(const WorkerPool::Result& result) {
+  complete_waiter(async_waiters_, result.job_id, "async", [&result](lua_State* thread) {
+    lua_pushboolean(thread, result.ok);
+    if (!result.ok) {
+      lua_pushlstring(thread, result.payload.data(), result.payload.size());
+      return 2;
     }
+    int n = zx::decode_values(thread, result.payload);
+    if (n < 0) {
+      lua_pop(thread, 1);
+      lua_pushboolean(thread, false);
+      lua_pushliteral(thread, "malformed async results");
+      return 2;
+    }
+    return n + 1;
+  });
+}
+
+int LunaContext::file_request(lua_State* ls, FileIo& io, FileIo::Op op, const std::filesystem::path& shared_dir) {
+  std::filesystem::path path{luaL_checkstring(ls, 1)};
+  std::string data;
+  int callback_idx = 2;
+  if (op != FileIo::Op::Read) {
+    size_t len;
+    const char* bytes = luaL_checklstring(ls, 2, &len);
+    data.assign(bytes, len);
+    callback_idx = 3;
+  }
+  if (!lua_isnoneornil(ls, callback_idx)) {
+    luaL_checktype(ls, callback_idx, LUA_TFUNCTION);
+  }
+  // the same places require looks: the module's own directory first, then the shared one.
+  std::filesystem::path fallback;
+  if (path.is_relative()) {
+    if (op == FileIo::Op::Read) {
+      fallback = shared_dir / path;
+    }
+    path = dir / path;
   }
-  return false;
+  Waiter waiter = make_waiter(ls, callback_idx, "luna.fs");
+  auto request_id = io.submit(id, op, std::move(path), std::move(fallback), std::move(data));
+  return await(ls, file_waiters_, request_id, waiter);
+}
+
+void LunaContext::complete_file(const FileIo::Result& result) {
+  complete_waiter(file_waiters_, result.id, "fs", [&result](lua_State* thread) {
+    lua_pushboolean(thread, result.ok);
+    if (result.ok && result.op != FileIo::Op::Read) {
+      return 1;
+    }
+    lua_pushlstring(thread, result.data.data(), result.data.size());
+    return 2;
+  });
+}
+
+LunaContext::Waiter LunaContext::make_waiter(lua_State* ls, int callback_idx, const char* what) {
+  Waiter waiter;
+  if (lua_isfunction(ls, callback_idx)) {
+    lua_pushvalue(ls, callback_idx);
+    waiter.callback = luaL_ref(ls, LUA_REGISTRYINDEX);
+    return waiter;
+  }
+  bool in_task = running_task_ != nullptr && ls == running_task_->co.thread;
+  if (!in_task && ls != threads_.pulse) {
+    luaL_error(ls, "%s needs a callback outside the pulse function, handlers and tasks", what);
+  }
+  // checked before anything is submitted, await can't fail to yield once the waiter is registered.
+  if (!lua_isyieldable(ls)) {
+    luaL_error(ls, "%s needs a callback where the caller can't yield, e.g. in a metamethod", what);
+  }
+  if (in_task) {
+    waiter.task_id = running_task_->id;
+  }
+  return waiter;
+}
+
+int LunaContext::await(lua_State* ls, Waiters& waiters, std::uint64_t id, Waiter waiter) {
+  waiters[id] = waiter;
+  if (waiter.callback != LUA_NOREF) {
+    lua_pushinteger(ls, lua_Integer(id));
+    return 1;
+  }
+  // no wake time, complete_waiter resumes it with the results.
+  if (waiter.task_id != 0) {
+    running_task_->wake = std::chrono::steady_clock::time_point::max();
+  } else {
+    sleep_time = std::chrono::steady_clock::time_point::max();
+  }
+  lua_settop(ls, 0);
+  return lua_yieldk(ls, 0, 0, await_continue);
+}
+
+int LunaContext::await_continue(lua_State* ls, int, lua_KContext) {
+  // resumed with ok followed by the results or the error message.
+  if (!lua_toboolean(ls, 1)) {
+    return lua_error(ls);
+  }
+  return lua_gettop(ls) - 1;
+}
+
+template <typename PushResults>
+void LunaContext::complete_waiter(Waiters& waiters, std::uint64_t id, const char* kind, PushResults push_results) {
+  auto it = waiters.find(id);
+  if (it == waiters.end()) {
+    return;
+  }
+  Waiter waiter = it->second;
+  waiters.erase(it);
+  Task* task = nullptr;
+  if (waiter.task_id != 0) {
+    // the task may have been cancelled while it was waiting.
+    auto found = tasks_.find(waiter.task_id);
+    task = found != tasks_.end() ? &found->second : nullptr;
+  }
+  if (exiting || (waiter.task_id != 0 && task == nullptr)) {
+    luaL_unref(threads_.main, LUA_REGISTRYINDEX, waiter.callback);
+    return;
+  }
+  // staged on the main thread, a waiting task or pulse function is suspended and can't run the push itself.
+  // Results too big for the memory limit reach the script as (false, "not enough memory") instead.
+  int base = lua_gettop(threads_.main);
+  int n = push_protected(threads_.main, push_results);
+  if (n < 0) {
+    auto no_memory = [](lua_State* l) {
+      lua_pushboolean(l, false);
+      lua_pushliteral(l, "not enough memory");
+      return 2;
+    };
+    n = push_protected(threads_.main, no_memory);
+  }
+  if (n < 0) {
+    luaL_unref(threads_.main, LUA_REGISTRYINDEX, waiter.callback);
+    out_of_memory();
+    return;
+  }
+  if (waiter.callback != LUA_NOREF) {
+    run_handler(waiter.callback, kind, threads_.event, [this, n](lua_State* thread) {
+      if (!lua_checkstack(thread, n)) {
+        return luaL_error(thread, "not enough memory");
+      }
+      lua_xmove(threads_.main, thread, n);
+      return n;
+    });
+    lua_settop(threads_.main, base);
+    luaL_unref(threads_.main, LUA_REGISTRYINDEX, waiter.callback);
+    return;
+  }
+  lua_State* thread = task != nullptr ? task->co.thread : threads_.pulse;
+  if (!lua_checkstack(thread, n)) {
+    lua_settop(threads_.main, base);
+    out_of_memory();
+    return;
+  }
+  lua_xmove(threads_.main, thread, n);
+  if (task != nullptr) {
+    resume_task(*task, n);
+    return;
+  }
+  pulse_resume_args_ = n;
+  sleep_time = luna->frame_time();
+  reschedule = true;
+}
+
+std::chrono::steady_clock::time_point LunaContext::next_wake(std::chrono::steady_clock::time_point now) {
+  auto wake = std::chrono::steady_clock::time_point::max();
+  if (keys_.pulse != LUA_NOREF) {
+    wake = std::max(sleep_time, now);
+  }
+  while (!task_heap_.empty()) {
+    const TaskWake& top = task_heap_.front();
+    if (tasks_.contains(top.id)) {
+      wake = std::min(wake, std::max(top.wake, now));
+      break;
+    }
+    std::pop_heap(task_heap_.begin(), task_heap_.end(), wakes_later);
+    task_heap_.pop_back();
+  }
+  return wake;
+}
+
+void LunaContext::do_command_bind(int fn_key, std::string_view args) {
+  auto start = std::chrono::steady_clock::now();
+  run_handler(fn_key, "bind", threads_.bind, [args](lua_State* thread) mutable {
+    // push the args for the function onto the stack, straight out of the queued command.
+    int nargs = 0;
+    while (!args.empty()) {
+      args.remove_prefix(std::min(args.find_first_not_of(' '), args.size()));
+      auto end = std::min(args.find(' '), args.size());
+      if (end == 0 || !lua_checkstack(thread, 1)) {
+        break;
+      }
+      lua_pushlstring(thread, args.data(), end);
+      args.remove_prefix(end);
+      ++nargs;
+    }
+    return nargs;
+  });
+  stats.latency(StatsHook::Bind).record(std::chrono::steady_clock::now() - start);
+}
+
+void LunaContext::do_event(int fn_key, std::string_view event_line, const EventMatches::Capture* captures,
+                           std::uint32_t capture_count) {
+  ++stats.events_dispatched;
+  auto start = std::chrono::steady_clock::now();
+  run_handler(fn_key, "event", threads_.event, [&](lua_State* thread) {
+    if (!lua_checkstack(thread, capture_count)) {
+      return 0;
+    }
+    // captures were recorded when the line was queued
+    for (auto l = 0u; l < capture_count; ++l) {
+      lua_pushlstring(thread, event_line.data() + captures[l].offset, captures[l].length);
+    }
+    return int(capture_count);
+  });
+  stats.latency(StatsHook::Event).record(std::chrono::steady_clock::now() - start);
 }
 
 int LunaContext::yield_event(lua_State* ls) {
+  // handlers sleep on their own wake time, everything else is the pulse function.
+  auto& wake = running_task_ != nullptr && ls == running_task_->co.thread ? running_task_->wake : sleep_time;
   int nargs = lua_gettop(ls);
   if (nargs > 0) {
     int type = lua_type(ls, 1);
@@ -282,15 +741,13 @@ int LunaContext::yield_event(lua_State* ls) {
       lua_getfield(ls, 1, "ms");
       auto ms = std::chrono::milliseconds(lua_tointeger(ls, -1));
       lua_pop(ls, 3);
-      auto now = std::chrono::steady_clock::now();
-      sleep_time = now + min + sec + ms;
+      wake = luna->frame_time() + min + sec + ms;
     } else if (type == LUA_TNUMBER) {
       int sleep_ms = luaL_checkinteger(ls, 1);
       if (!lua_isinteger(ls, 1)) {
         return 0;
       }
-      auto now = std::chrono::steady_clock::now();
-      sleep_time = now + std::chrono::milliseconds(sleep_ms);
+      wake = luna->frame_time() + std::chrono::milliseconds(sleep_ms);
       lua_pop(ls, 1);
     } else {
       return luaL_error(ls, "unknown argument passed to luna.yield with type %s. Nargs: %d", luaL_typename(ls, 1), nargs);
@@ -299,16 +756,16 @@ int LunaContext::yield_event(lua_State* ls) {
   return lua_yield(ls, 0);
 }
 
-void LunaContext::pulse() {
+void LunaContext::pulse(std::chrono::steady_clock::time_point now) {
   if (exiting) {
     DLOG("Attempted to call pulse in exiting content.")
     return;
   }
-  if (paused || keys_.pulse == LUA_NOREF) {
+  if (paused) {
     return;
   }
-  auto now = std::chrono::steady_clock::now();
-  if (sleep_time > now) {
+  resume_due_tasks(now);
+  if (exiting || keys_.pulse == LUA_NOREF || sleep_time > now) {
     return;
   }
   if (!pulse_yielding) {
@@ -320,17 +777,37 @@ void LunaContext::pulse() {
       return;
     }
   }
+  slice_instructions_ = 0;
+  if (budget_.microseconds > 0) {
+    slice_start_ = std::chrono::steady_clock::now();
+  }
   int nargs;
-  auto ret = lua_resume(threads_.pulse, nullptr, 0, &nargs);
+  ++stats.resumes;
+  auto start = std::chrono::steady_clock::now();
+  auto ret = [&] {
+    auto armed = arm_memory_limit();
+    return lua_resume(threads_.pulse, nullptr, std::exchange(pulse_resume_args_, 0), &nargs);
+  }();
+  stats.latency(StatsHook::Pulse).record(std::chrono::steady_clock::now() - start);
   switch (ret) {
   case LUA_OK:
     pulse_yielding = false;
+    run_instructions_ = 0;
     break;
   case LUA_YIELD:
     pulse_yielding = true;
+    if (preempted_) {
+      // out of budget, sleep_time is untouched so it picks up where it left off next frame.
+      preempted_ = false;
+      ++preemptions;
+    } else {
+      run_instructions_ = 0;
+    }
     break;
-  case LUA_ERRRUN:
   case LUA_ERRMEM:
+    out_of_memory();
+    return;
+  case LUA_ERRRUN:
   case LUA_ERRSYNTAX:
   case LUA_ERRFILE:
     LOG("Received a lua error, stopping module %s.", name.c_str());
@@ -349,23 +826,164 @@ void LunaContext::pulse() {
   }
 }
 
-void LunaContext::zoned() { call_registry_fn(keys_.zoned, "zoned", threads_.event); }
-void LunaContext::reload_ui() { call_registry_fn(keys_.reload, "reload_ui", threads_.event); }
-void LunaContext::draw_hud() { call_registry_fn(keys_.draw, "draw_hud", threads_.event); }
+int LunaContext::set_budget(lua_State* ls) {
+  budget_ = {};
+  if (lua_gettop(ls) > 0) {
+    luaL_checktype(ls, 1, LUA_TTABLE);
+    lua_getfield(ls, 1, "instructions");
+    budget_.instructions = lua_tointeger(ls, -1);
+    lua_getfield(ls, 1, "us");
+    budget_.microseconds = lua_tointeger(ls, -1);
+    lua_getfield(ls, 1, "watchdog");
+    budget_.watchdog = lua_tointeger(ls, -1);
+    lua_pop(ls, 3);
+  }
+  DLOG("%s budget: %lld instructions, %lld us, watchdog %lld", name.c_str(), (long long)budget_.instructions,
+       (long long)budget_.microseconds, (long long)budget_.watchdog);
+  update_hooks();
+  return 0;
+}
+
+void LunaContext::update_hooks() {
+  auto set_hook = [](lua_State* thread, bool enabled) {
+    lua_sethook(thread, enabled ? count_hook : nullptr, enabled ? LUA_MASKCOUNT : 0, hook_period);
+  };
+  set_hook(threads_.main, profiling_);
+  set_hook(threads_.pulse, budget_.instructions > 0 || budget_.microseconds > 0 || budget_.watchdog > 0 || profiling_);
+  // handlers aren't preempted, only the watchdog applies to them.
+  set_hook(threads_.event, hook_handlers());
+  set_hook(threads_.bind, hook_handlers());
+  for (auto&& [id, task] : tasks_) {
+    set_hook(task.co.thread, hook_handlers());
+  }
+}
+
+void LunaContext::start_profile() {
+  profile_samples_.clear();
+  profile_countdown_ = profile_every;
+  profiling_ = true;
+  update_hooks();
+}
+
+std::unordered_map<std::string, std::uint64_t> LunaContext::stop_profile() {
+  profiling_ = false;
+  update_hooks();
+  return std::move(profile_samples_);
+}
+
+void LunaContext::sample_stack(lua_State* ls) {
+  // folded stack format: thread;outermost;...;innermost
+  std::string& key = profile_key_;
+  if (ls == threads_.pulse) {
+    key = "pulse";
+  } else if (ls == threads_.event) {
+    key = "event";
+  } else if (ls == threads_.bind) {
+    key = "bind";
+  } else if (running_task_ != nullptr && ls == running_task_->co.thread) {
+    key = running_task_->kind;
+  } else {
+    key = "main";
+  }
+  lua_Debug ar;
+  int depth = 0;
+  while (depth < profile_max_depth && lua_getstack(ls, depth, &ar)) {
+    ++depth;
+  }
+  // short_src alone can be LUA_IDSIZE long.
+  char frame[LUA_IDSIZE + 16];
+  for (int level = depth - 1; level >= 0; --level) {
+    lua_getstack(ls, level, &ar);
+    lua_getinfo(ls, "Sn", &ar);
+    key += ';';
+    if (ar.name != nullptr) {
+      key += ar.name;
+    } else if (*ar.what == 'm') {
+      key += "main chunk";
+    } else {
+      key += '?';
+    }
+    std::snprintf(frame, sizeof(frame), " (%s:%d)", ar.short_src, ar.linedefined);
+    key += frame;
+  }
+  ++profile_samples_[key];
+}
+
+void LunaContext::count_hook(lua_State* ls, lua_Debug* ar) {
+  auto ctx = *static_cast<LunaContext**>(lua_getextraspace(ls));
+  if (ctx != nullptr) {
+    ctx->on_count_hook(ls, ar);
+  }
+}
+
+void LunaContext::on_count_hook(lua_State* ls, lua_Debug* ar) {
+  if (!watchdog_error_.empty()) {
+    lua_pushstring(ls, watchdog_error_.c_str());
+    lua_error(ls);
+    return;
+  }
+  if (profiling_ && --profile_countdown_ <= 0) {
+    profile_countdown_ = profile_every;
+    sample_stack(ls);
+  }
+  bool on_pulse = ls == threads_.pulse;
+  lua_Integer& ran = on_pulse ? run_instructions_ : handler_instructions_;
+  ran += hook_period;
+  if (budget_.watchdog > 0 && ran > budget_.watchdog) {
+    lua_getinfo(ls, "Sl", ar);
+    lua_pushfstring(ls, "watchdog: %s ran %I instructions without yielding, stopped at %s:%d", name.c_str(), ran,
+                    ar->short_src, ar->currentline);
+    watchdog_error_ = lua_tostring(ls, -1);
+    exiting = true;
+    // a pcall around the spinning code would catch the error and carry on, so it's raised again on every
+    // instruction until it gets out to Luna's resume or pcall.
+    lua_sethook(ls, count_hook, LUA_MASKCOUNT, 1);
+    lua_error(ls);
+    return;
+  }
+  if (!on_pulse || !lua_isyieldable(ls)) {
+    return;
+  }
+  slice_instructions_ += hook_period;
+  bool out_of_budget = budget_.instructions > 0 && slice_instructions_ >= budget_.instructions;
+  if (!out_of_budget && budget_.microseconds > 0) {
+    out_of_budget = std::chrono::steady_clock::now() - slice_start_ >= std::chrono::microseconds(budget_.microseconds);
+  }
+  if (out_of_budget) {
+    preempted_ = true;
+    // count hooks may yield as long as they yield nothing.
+    lua_yield(ls, 0);
+  }
+}
+
+void LunaContext::zoned() { call_registry_fn(keys_.zoned, StatsHook::Zoned, threads_.event); }
+void LunaContext::reload_ui() { call_registry_fn(keys_.reload, StatsHook::ReloadUI, threads_.event); }
+void LunaContext::draw_hud() { call_registry_fn(keys_.draw, StatsHook::DrawHUD, threads_.event); }
 void LunaContext::set_game_state(GameState) {
-  call_registry_fn(keys_.gamestate_changed, "gamestate_changed", threads_.event);
+  call_registry_fn(keys_.gamestate_changed, StatsHook::GameStateChanged, threads_.event);
 }
 
-void LunaContext::call_registry_fn(int key, const char* fn_name, lua_State* thread) {
+void LunaContext::call_registry_fn(int key, StatsHook hook, lua_State* thread) {
   if (exiting || key == LUA_NOREF) {
     return;
   }
+  const char* fn_name = stats_hook_name(hook);
   auto type = lua_rawgeti(thread, LUA_REGISTRYINDEX, key);
   if (type != LUA_TFUNCTION) {
     LOG("\ar%s key is set, but not a function? Please report!", fn_name);
     return;
   }
-  if (lua_pcall(thread, 0, 0, 0) != LUA_OK) {
+  handler_instructions_ = 0;
+  auto start = std::chrono::steady_clock::now();
+  auto status = [&] {
+    auto armed = arm_memory_limit();
+    return lua_pcall(thread, 0, 0, 0);
+  }();
+  stats.latency(hook).record(std::chrono::steady_clock::now() - start);
+  if (status == LUA_ERRMEM) {
+    out_of_memory();
+  }
+  if (status != LUA_OK) {
     const char* event_msg = lua_tostring(thread, -1);
     LOG("\ar%s handler had an error!", fn_name);
     if (event_msg != nullptr) {
@@ -375,6 +993,54 @@ void LunaContext::call_registry_fn(int key, const char* fn_name, lua_State* thre
   }
 }
 
+void LunaContext::configure_gc(const ModuleConfig& conf) {
+  gc_mode_ = conf.gc_mode;
+  if (gc_mode_ == GcMode::Generational) {
+    lua_gc(threads_.main, LUA_GCGEN, conf.gc_minor_mul, 0);
+  } else {
+    lua_gc(threads_.main, LUA_GCINC, conf.gc_pause, conf.gc_stepmul, 0);
+  }
+}
+
+bool LunaContext::gc_wanted(std::size_t slack) const {
+  return gc_in_cycle_ || allocator_->stats().current_bytes >= gc_clean_bytes_ + slack;
+}
+
+bool LunaContext::gc_step(int kb) {
+  auto start = std::chrono::steady_clock::now();
+  // generational steps are whole minor collections, there's no cycle to finish.
+  bool done = lua_gc(threads_.main, LUA_GCSTEP, kb) == 1 || gc_mode_ == GcMode::Generational;
+  stats.gc_time += std::chrono::steady_clock::now() - start;
+  ++stats.gc_steps;
+  gc_in_cycle_ = !done;
+  if (done) {
+    gc_clean_bytes_ = allocator_->stats().current_bytes;
+  }
+  return done;
+}
+
+void LunaContext::install_gc_sentinel() {
+  lua_State* ls = threads_.main;
+  luaL_newmetatable(ls, gc_sentinel_meta);
+  lua_pushlightuserdata(ls, this);
+  lua_pushcclosure(ls, gc_sentinel, 1);
+  lua_setfield(ls, -2, "__gc");
+  lua_newuserdatauv(ls, 0, 0);
+  lua_insert(ls, -2);
+  lua_setmetatable(ls, -2);
+  lua_pop(ls, 1);
+}
+
+int LunaContext::gc_sentinel(lua_State* ls) {
+  auto ctx = static_cast<LunaContext*>(lua_touserdata(ls, lua_upvalueindex(1)));
+  ++ctx->stats.gc_cycles;
+  // unreachable again right away, so the next cycle collects it too.
+  lua_newuserdatauv(ls, 0, 0);
+  luaL_setmetatable(ls, gc_sentinel_meta);
+  lua_pop(ls, 1);
+  return 0;
+}
+
 void LunaContext::exit_fn() {
   if (did_exit_) {
     return;
@@ -389,6 +1055,8 @@ void LunaContext::exit_fn() {
     LOG("\arexit_fn key is set, but not a function? Please report!");
     return;
   }
+  // at_exit runs even after the watchdog stopped the module.
+  lua_sethook(threads_.main, nullptr, 0, 0);
   if (lua_pcall(threads_.main, 0, 0, 0) != LUA_OK) {
     const char* event_msg = lua_tostring(threads_.main, -1);
     LOG("\arat_exit handler had an error!");
@@ -398,3 +1066,13 @@ void LunaContext::exit_fn() {
     }
   }
 }
+
+void LunaContext::out_of_memory() {
+  if (exiting) {
+    return;
+  }
+  auto stats = allocator_->stats();
+  LOG("\armodule %s ran out of memory (%zu KB in use, limit %zu KB), stopping it.", name.c_str(),
+      stats.current_bytes / 1024, allocator_->limit() / 1024);
+  exiting = true;
+}
@@ -12,6 +12,7 @@
 #include "utils.hpp"
 
 void Luna::OnZoned() {
+  invalidate_data_cache();
   for (auto&& ctx : luna_ctxs_) {
     ctx->zoned();
   }
@@ -37,51 +38,88 @@ void Luna::SetGameState(GameState game_state) {
   }
 }
 
-void Luna::do_binds() {
-  // index-based loop because it may be possible that more binds are added
-  // during.
+void Luna::queue_binds() {
   for (auto i = 0u; i < todo_bind_commands_.size(); ++i) {
-    auto cmd_str = todo_bind_commands_[i];
-    DLOG("processing %s", cmd_str.c_str());
-    auto sv = std::string_view{cmd_str};
+    auto sv = todo_bind_commands_[i];
+    DLOG("processing %.*s", int(sv.size()), sv.data());
     // remove leading spaces
     sv.remove_prefix(std::min(sv.find_first_not_of(" "), sv.size()));
     if (sv.size() == 0) {
       continue;
     }
-    // split on whitespace
-    auto args = zx::strsplit(sv);
-    // first cmd is the function name
-    auto cmd = args[0];
-
-    LunaContext* ctx_ptr = nullptr;
-    for (const std::unique_ptr<LunaContext>& ctx : luna_ctxs_) {
-      if (ctx->has_command_binding(cmd)) {
-        ctx_ptr = ctx.get();
-        break;
+    // first word is the function name, the rest are its args
+    auto split = std::min(sv.find(' '), sv.size());
+    auto cmd = sv.substr(0, split);
+    const BindRouter::Route* route = bind_router_.find(cmd);
+    if (route == nullptr) {
+      LOG("No luna command found for '%.*s'", int(cmd.size()), cmd.data());
+      continue;
+    }
+    handler_queue_.add_bind(route->ctx, route->fn_key, sv.substr(split));
+  }
+  // binds that handlers queue are handled next pulse.
+  todo_bind_commands_.clear();
+}
+
+void Luna::queue_events() {
+  while (!todo_events_.empty()) {
+    std::string_view line = todo_events_.front_line();
+    const EventMatches& matches = todo_events_.front_matches();
+    for (const EventMatches::Hit& hit : matches.hits) {
+      const EventMatcher::Pattern& pattern = event_matcher_.pattern(hit.pattern_id);
+      // the module may have been stopped since the line was queued.
+      if (!pattern.live) {
+        continue;
       }
+      handler_queue_.add_event(pattern.ctx, pattern.fn_key, line, matches.captures.data() + hit.first_capture,
+                               hit.capture_count);
     }
+    todo_events_.pop();
+  }
+  // no pattern ids are held until the next line is matched, the dead patterns of stopped modules can go.
+  event_matcher_.compact();
+}
+
+bool Luna::over_budget(std::chrono::steady_clock::time_point frame_start) const {
+  return config_.frame_budget_us > 0 &&
+         std::chrono::steady_clock::now() - frame_start >= std::chrono::microseconds(config_.frame_budget_us);
+}
 
-    if (ctx_ptr == nullptr) {
-      LOG("No luna command found for '%s'", cmd_str.c_str());
+void Luna::run_handlers(Priority priority, std::chrono::steady_clock::time_point frame_start) {
+  for (const HandlerQueue::Call& call : handler_queue_.calls(priority)) {
+    LunaContext* ctx = call.ctx;
+    if (call.waited < config_.max_deferred_frames && over_budget(frame_start)) {
+      handler_queue_.carry_over(call);
+      ++ctx->stats.deferrals;
       continue;
     }
-    ctx_ptr->do_command_bind(std::move(args));
+    if (call.event) {
+      ctx->do_event(call.fn_key, handler_queue_.text(call), handler_queue_.captures(call), call.capture_count);
+    } else {
+      ctx->do_command_bind(call.fn_key, handler_queue_.text(call));
+    }
+    reschedule_if_needed(ctx);
   }
-  todo_bind_commands_.clear();
 }
 
-void Luna::do_events() {
-  std::smatch cm;
-  // index-based loop because it may be possible that more events are added
-  // during.
-  for (auto k = 0u; k < todo_events_.size(); ++k) {
-    const std::string& event_str = todo_events_[k];
-    for (auto&& ctx : luna_ctxs_) {
-      ctx->do_event(event_str);
+void Luna::run_pulses(Priority priority, std::chrono::steady_clock::time_point frame_start) {
+  for (LunaContext* ctx : due_pulses_) {
+    if (ctx->priority != priority) {
+      continue;
+    }
+    if (ctx->deferred_frames < config_.max_deferred_frames && over_budget(frame_start)) {
+      // still due, so it comes up again next frame.
+      ++ctx->deferred_frames;
+      ++ctx->stats.deferrals;
+      schedule_pulse(ctx, frame_time_);
+      continue;
     }
+    ctx->deferred_frames = 0;
+    ctx->pulse(frame_time_);
+    // a context that yielded without a sleep (or returned) runs again next frame.
+    ctx->reschedule = false;
+    schedule_pulse(ctx, ctx->next_wake(frame_time_));
   }
-  todo_events_.clear();
 }
 
 void Luna::do_luna_commands() {
@@ -91,7 +129,7 @@ void Luna::do_luna_commands() {
     if (sv.starts_with("run ")) {
       sv.remove_prefix(4);
       sv.remove_prefix(std::min(sv.find_first_not_of(" "), sv.size()));
-      run_module(sv);
+      run_modules(sv);
     } else if (sv.starts_with("stop ")) {
       sv.remove_prefix(5);
       sv.remove_prefix(std::min(sv.find_first_not_of(" "), sv.size()));
@@ -102,6 +140,24 @@ void Luna::do_luna_commands() {
       pause_module(sv);
     } else if (sv == "info") {
       print_info();
+    } else if (sv.starts_with("profile ")) {
+      sv.remove_prefix(8);
+      sv.remove_prefix(std::min(sv.find_first_not_of(" "), sv.size()));
+      profile_command(sv);
+    } else if (sv.starts_with("bench ")) {
+      sv.remove_prefix(6);
+      sv.remove_prefix(std::min(sv.find_first_not_of(" "), sv.size()));
+      bench_command(sv);
+    } else if (sv.starts_with("record")) {
+      sv.remove_prefix(6);
+      sv.remove_prefix(std::min(sv.find_first_not_of(" "), sv.size()));
+      record_command(sv);
+    } else if (sv.starts_with("stats")) {
+      sv.remove_prefix(5);
+      sv.remove_prefix(std::min(sv.find_first_not_of(" "), sv.size()));
+      stats_command(sv);
+    } else if (sv == "events") {
+      print_event_stats();
     } else if (sv == "list") {
       list_available_modules();
     } else if (sv == "help") {
@@ -115,28 +171,46 @@ void Luna::do_luna_commands() {
 }
 
 void Luna::OnPulse() {
+  auto frame_start = std::chrono::steady_clock::now();
+  frame_time_ = zx::now();
+  invalidate_data_cache();
   do_luna_commands();
-  do_events();
-  do_binds();
+  deliver_async_results();
+  start_compiled_modules();
   in_pulse_ = true;
 
   cleanup_exiting_contexts();
-  for (const std::unique_ptr<LunaContext>& ctx : luna_ctxs_) {
-    ctx->pulse();
+  // what was put off last frame comes first within its class.
+  handler_queue_.begin_frame();
+  queue_events();
+  queue_binds();
+  // only contexts whose wake up time has passed are touched, sleeping and paused ones cost nothing.
+  pop_due_pulses(frame_time_);
+  for (auto priority = 0u; priority < std::size_t(Priority::Count); ++priority) {
+    run_handlers(Priority(priority), frame_start);
+    run_pulses(Priority(priority), frame_start);
+  }
+  ++frames_;
+  if (over_budget(frame_start)) {
+    ++over_budget_frames_;
   }
   in_pulse_ = false;
+  refill_state_pool(frame_start);
+  step_collectors(frame_start);
+  flush_chat(config_.chat_lines_per_frame);
 }
 
 void Luna::OnWriteChatColor(const char* line, std::uint32_t color, std::uint32_t filter) {}
 
 void Luna::OnIncomingChat(const char* line, std::uint32_t color) {
-  for (auto&& ctx : luna_ctxs_) {
-    if (ctx->matches_event(line)) {
-      todo_events_.emplace_back(std::string{line});
-      return;
+  event_matcher_.match(line, intake_matches_);
+  if (!intake_matches_.empty()) {
+    for (const EventMatches::Hit& hit : intake_matches_.hits) {
+      ++event_matcher_.pattern(hit.pattern_id).ctx->stats.events_matched;
     }
+    todo_events_.push(line, intake_matches_);
   }
 }
 
-void Luna::OnBeginZone() {}
+void Luna::OnBeginZone() { invalidate_data_cache(); }
 void Luna::OnEndZone() {}
@@ -0,0 +1,92 @@
+/*
+ * module_stats.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#include "module_stats.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+namespace {
+const char* const hook_names[] = {
+    "pulse", "event", "bind", "zoned", "reload_ui", "draw_hud", "gamestate_changed",
+};
+static_assert(sizeof(hook_names) / sizeof(hook_names[0]) == std::size_t(StatsHook::Count));
+} // namespace
+
+const char* stats_hook_name(StatsHook hook) { return hook_names[std::size_t(hook)]; }
+
+void LatencyHistogram::record(std::chrono::steady_clock::duration d) {
+  auto ns = std::uint64_t(std::max<std::int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count(), 0));
+  ++counts_[bucket_of(ns)];
+  ++count_;
+  total_ns_ += ns;
+  max_ns_ = std::max(max_ns_, ns);
+}
+
+std::uint64_t LatencyHistogram::percentile_ns(double p) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  auto target = std::max<std::uint64_t>(std::uint64_t(std::ceil(p * double(count_))), 1);
+  std::uint64_t seen = 0;
+  // the last bucket has no bound of its own, only the max.
+  for (std::size_t bucket = 0; bucket + 1 < num_buckets; ++bucket) {
+    seen += counts_[bucket];
+    if (seen >= target) {
+      return std::min(bucket_limit(bucket), max_ns_);
+    }
+  }
+  return max_ns_;
+}
+
+void LatencyHistogram::reset() {
+  counts_.fill(0);
+  count_ = 0;
+  total_ns_ = 0;
+  max_ns_ = 0;
+}
+
+std::size_t LatencyHistogram::bucket_of(std::uint64_t ns) {
+  if (ns < sub_count) {
+    return std::size_t(ns);
+  }
+  int magnitude = std::bit_width(ns) - 1;
+  if (magnitude >= max_bits) {
+    return num_buckets - 1;
+  }
+  // the bits right below the leading one pick the bucket within its power of two.
+  int shift = magnitude - sub_bits;
+  return std::size_t(shift + 1) * sub_count + std::size_t((ns >> shift) - sub_count);
+}
+
+std::uint64_t LatencyHistogram::bucket_limit(std::size_t bucket) {
+  if (bucket < sub_count) {
+    return bucket;
+  }
+  int shift = int(bucket / sub_count) - 1;
+  std::uint64_t first = (sub_count + bucket % sub_count) << shift;
+  return first + (std::uint64_t(1) << shift) - 1;
+}
+
+ModuleStats::ModuleStats() : since{std::chrono::steady_clock::now()} {}
+
+void ModuleStats::reset() {
+  since = std::chrono::steady_clock::now();
+  resumes = 0;
+  events_matched = 0;
+  events_dispatched = 0;
+  data_calls = 0;
+  commands = 0;
+  deferrals = 0;
+  gc_cycles = 0;
+  gc_steps = 0;
+  gc_time = {};
+  for (LatencyHistogram& histogram : latency_) {
+    histogram.reset();
+  }
+}
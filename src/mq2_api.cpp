@@ -6,8 +6,10 @@
  */
 
 #include "mq2_api.hpp"
+#include "trace.hpp"
 #include <cstring>
 #include <libloaderapi.h>
+#include <string>
 
 __declspec(dllexport) float MQ2Version = 0.1f;
 #define MAX_STRING 2048
@@ -16,7 +18,37 @@ MQ2* mq2;
 
 namespace {
 char scratch_buf[4096] = {'\0'};
+std::string trace_expr;
+
+// for /luna record, the answer in terms of the converter luna is going to pick for it.
+void record_answer(std::string_view expr, BOOL ok, const MQ2TypeVar& result) {
+  TraceAnswer answer;
+  if (!ok) {
+    answer.kind = TraceAnswer::Kind::None;
+  } else if (result.Type == mq2->pIntType) {
+    answer.kind = TraceAnswer::Kind::Int;
+    answer.integer = result.Int;
+  } else if (result.Type == mq2->pInt64Type) {
+    answer.kind = TraceAnswer::Kind::Int64;
+    answer.integer = result.Int64;
+  } else if (result.Type == mq2->pFloatType) {
+    answer.kind = TraceAnswer::Kind::Float;
+    answer.number = result.Float;
+  } else if (result.Type == mq2->pDoubleType) {
+    answer.kind = TraceAnswer::Kind::Double;
+    answer.number = result.Double;
+  } else if (result.Type == mq2->pStringType) {
+    answer.kind = result.Ptr != nullptr ? TraceAnswer::Kind::String : TraceAnswer::Kind::None;
+    if (result.Ptr != nullptr) {
+      answer.string = static_cast<const char*>(result.Ptr);
+    }
+  } else {
+    answer.kind = TraceAnswer::Kind::Other;
+    answer.integer = result.DWord;
+  }
+  zx::trace_recorder.data(expr, answer);
 }
+} // namespace
 
 MQ2::MQ2() {
   auto mq2_module = GetModuleHandle("MQ2Main.dll");
@@ -49,7 +81,25 @@ BOOL MQ2::ParseMQ2DataPortion(const char* data_var, MQ2TypeVar& result) {
     return false;
   }
   std::strcpy(scratch_buf, data_var);
-  return ParseMQ2DataPortionFP(scratch_buf, result);
+  BOOL ok = ParseMQ2DataPortionFP(scratch_buf, result);
+  if (zx::trace_recorder.recording()) {
+    record_answer(data_var, ok, result);
+  }
+  return ok;
+}
+
+BOOL MQ2::ParseMQ2DataPortionInPlace(PCHAR buf, MQ2TypeVar& result) {
+  if (ParseMQ2DataPortionFP == nullptr) {
+    return false;
+  }
+  if (!zx::trace_recorder.recording()) {
+    return ParseMQ2DataPortionFP(buf, result);
+  }
+  // MQ2 scribbles over buf.
+  trace_expr.assign(buf);
+  BOOL ok = ParseMQ2DataPortionFP(buf, result);
+  record_answer(trace_expr, ok, result);
+  return ok;
 }
 
 VOID MQ2::WriteChatColor(const char* Line, DWORD Color, DWORD Filter) {
@@ -60,6 +110,13 @@ VOID MQ2::WriteChatColor(const char* Line, DWORD Color, DWORD Filter) {
   WriteChatColorFP(scratch_buf, Color, Filter);
 }
 
+VOID MQ2::WriteChatColorInPlace(PCHAR Line, DWORD Color, DWORD Filter) {
+  if (WriteChatColorFP == nullptr) {
+    return;
+  }
+  WriteChatColorFP(Line, Color, Filter);
+}
+
 void MQ2::DoCommand(PSPAWNINFO pChar, const char* szLine) {
   if (pChar == nullptr || HideDoCommandFP == nullptr) {
     return;
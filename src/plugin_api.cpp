@@ -7,6 +7,7 @@
 
 #include "luna.hpp"
 #include "mq2_api.hpp"
+#include "trace.hpp"
 #include <windows.h>
 
 #define PLUGIN_API extern "C" __declspec(dllexport)
@@ -19,6 +20,7 @@ void LunaCmd(PSPAWNINFO, PCHAR cmd) {
   if (!luna || !mq2) {
     return;
   }
+  zx::trace_recorder.command(TraceKind::LunaCommand, cmd);
   luna->Cmd(cmd);
 }
 
@@ -26,6 +28,7 @@ void LunaDo(PSPAWNINFO, PCHAR cmd) {
   if (!luna || !mq2) {
     return;
   }
+  zx::trace_recorder.command(TraceKind::BindCommand, cmd);
   luna->BoundCommand(cmd);
 }
 
@@ -39,6 +42,7 @@ PLUGIN_API VOID InitializePlugin(VOID) {
 }
 
 PLUGIN_API VOID ShutdownPlugin(VOID) {
+  zx::trace_recorder.stop();
   mq2->RemoveCommand("/ldo");
   mq2->RemoveCommand("/luna");
   delete luna;
@@ -49,36 +53,42 @@ PLUGIN_API VOID ShutdownPlugin(VOID) {
 
 PLUGIN_API VOID OnZoned(VOID) {
   if (luna) {
+    zx::trace_recorder.hook(TraceKind::Zoned);
     luna->OnZoned();
   }
 }
 
 PLUGIN_API VOID OnCleanUI(VOID) {
   if (luna) {
+    zx::trace_recorder.hook(TraceKind::CleanUI);
     luna->OnCleanUI();
   }
 }
 
 PLUGIN_API VOID OnReloadUI(VOID) {
   if (luna) {
+    zx::trace_recorder.hook(TraceKind::ReloadUI);
     luna->OnReloadUI();
   }
 }
 
 PLUGIN_API VOID OnDrawHUD(VOID) {
   if (luna) {
+    zx::trace_recorder.hook(TraceKind::DrawHUD);
     luna->OnDrawHUD();
   }
 }
 
 PLUGIN_API VOID SetGameState(DWORD game_state) {
   if (luna) {
+    zx::trace_recorder.game_state(game_state);
     luna->SetGameState(GameState{game_state});
   }
 }
 
 PLUGIN_API VOID OnPulse(VOID) {
   if (luna) {
+    zx::trace_recorder.hook(TraceKind::Pulse);
     luna->OnPulse();
   }
 }
@@ -92,6 +102,7 @@ PLUGIN_API DWORD OnWriteChatColor(PCHAR Line, DWORD Color, DWORD Filter) {
 
 PLUGIN_API DWORD OnIncomingChat(PCHAR Line, DWORD Color) {
   if (luna) {
+    zx::trace_recorder.chat(Line, Color);
     luna->OnIncomingChat(Line, Color);
   }
   return 0;
@@ -113,12 +124,14 @@ PLUGIN_API DWORD OnIncomingChat(PCHAR Line, DWORD Color) {
 
 PLUGIN_API VOID OnBeginZone(VOID) {
   if (luna) {
+    zx::trace_recorder.hook(TraceKind::BeginZone);
     luna->OnBeginZone();
   }
 }
 
 PLUGIN_API VOID OnEndZone(VOID) {
   if (luna) {
+    zx::trace_recorder.hook(TraceKind::EndZone);
     luna->OnEndZone();
   }
 }
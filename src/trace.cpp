@@ -0,0 +1,258 @@
+/*
+ * trace.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#include "trace.hpp"
+
+#include <cstring>
+
+namespace {
+constexpr char trace_magic[4] = {'L', 'T', 'R', 'C'};
+constexpr std::uint8_t trace_version = 1;
+constexpr std::size_t flush_size = 64 * 1024;
+// longer strings than this are a corrupt trace rather than a chat line.
+constexpr std::uint64_t max_string = 1 << 20;
+
+const char* const kind_names[] = {
+    "?",        "pulse",      "draw_hud", "zoned",        "begin_zone",   "end_zone", "clean_ui",
+    "reload_ui", "game_state", "chat",     "luna_command", "bind_command", "data",
+};
+static_assert(sizeof(kind_names) / sizeof(kind_names[0]) == std::size_t(TraceKind::Count));
+
+std::uint64_t zigzag(std::int64_t v) { return (std::uint64_t(v) << 1) ^ std::uint64_t(v >> 63); }
+std::int64_t unzigzag(std::uint64_t v) { return std::int64_t(v >> 1) ^ -std::int64_t(v & 1); }
+} // namespace
+
+namespace zx {
+TraceRecorder trace_recorder;
+} // namespace zx
+
+const char* trace_kind_name(TraceKind kind) {
+  auto i = std::size_t(kind);
+  return i < std::size_t(TraceKind::Count) ? kind_names[i] : kind_names[0];
+}
+
+TraceRecorder::~TraceRecorder() { stop(); }
+
+bool TraceRecorder::start(const std::filesystem::path& path) {
+  stop();
+  std::error_code ec;
+  std::filesystem::create_directories(path.parent_path(), ec);
+  out_.open(path, std::ios::binary | std::ios::trunc);
+  if (!out_) {
+    return false;
+  }
+  buf_.assign(trace_magic, sizeof(trace_magic));
+  buf_ += char(trace_version);
+  start_ = std::chrono::steady_clock::now();
+  last_us_ = 0;
+  records = 0;
+  bytes = 0;
+  recording_ = true;
+  return true;
+}
+
+void TraceRecorder::stop() {
+  if (!recording_) {
+    return;
+  }
+  flush();
+  out_.close();
+  recording_ = false;
+}
+
+void TraceRecorder::begin(TraceKind kind) {
+  auto now_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_).count();
+  buf_ += char(kind);
+  put_varint(std::uint64_t(now_us - last_us_));
+  last_us_ = now_us;
+  ++records;
+}
+
+void TraceRecorder::hook(TraceKind kind) {
+  if (!recording_) {
+    return;
+  }
+  begin(kind);
+  flush_if_full();
+}
+
+void TraceRecorder::game_state(std::uint32_t state) {
+  if (!recording_) {
+    return;
+  }
+  begin(TraceKind::GameState);
+  put_varint(state);
+  flush_if_full();
+}
+
+void TraceRecorder::chat(std::string_view line, std::uint32_t color) {
+  if (!recording_) {
+    return;
+  }
+  begin(TraceKind::Chat);
+  put_varint(color);
+  put_string(line);
+  flush_if_full();
+}
+
+void TraceRecorder::command(TraceKind kind, std::string_view line) {
+  if (!recording_) {
+    return;
+  }
+  begin(kind);
+  put_string(line);
+  flush_if_full();
+}
+
+void TraceRecorder::data(std::string_view expr, const TraceAnswer& answer) {
+  if (!recording_) {
+    return;
+  }
+  begin(TraceKind::Data);
+  put_string(expr);
+  buf_ += char(answer.kind);
+  switch (answer.kind) {
+  case TraceAnswer::Kind::None:
+    break;
+  case TraceAnswer::Kind::Float:
+  case TraceAnswer::Kind::Double: {
+    char raw[sizeof(double)];
+    std::memcpy(raw, &answer.number, sizeof(raw));
+    buf_.append(raw, sizeof(raw));
+    break;
+  }
+  case TraceAnswer::Kind::String:
+    put_string(answer.string);
+    break;
+  default:
+    put_varint(zigzag(answer.integer));
+  }
+  flush_if_full();
+}
+
+void TraceRecorder::put_varint(std::uint64_t v) {
+  while (v >= 0x80) {
+    buf_ += char(v | 0x80);
+    v >>= 7;
+  }
+  buf_ += char(v);
+}
+
+void TraceRecorder::put_string(std::string_view sv) {
+  put_varint(sv.size());
+  buf_.append(sv);
+}
+
+void TraceRecorder::flush_if_full() {
+  if (buf_.size() >= flush_size) {
+    flush();
+  }
+}
+
+void TraceRecorder::flush() {
+  out_.write(buf_.data(), std::streamsize(buf_.size()));
+  bytes += buf_.size();
+  buf_.clear();
+}
+
+bool TraceReader::open(const std::filesystem::path& path) {
+  in_.open(path, std::ios::binary);
+  char header[sizeof(trace_magic) + 1];
+  if (!in_.read(header, sizeof(header))) {
+    return false;
+  }
+  time_us_ = 0;
+  return std::memcmp(header, trace_magic, sizeof(trace_magic)) == 0 && header[4] == char(trace_version);
+}
+
+bool TraceReader::next(TraceRecord& out) {
+  int kind = in_.get();
+  std::uint64_t delta;
+  if (kind <= 0 || kind >= int(TraceKind::Count) || !get_varint(delta)) {
+    return false;
+  }
+  time_us_ += std::int64_t(delta);
+  out.kind = TraceKind(kind);
+  out.time = std::chrono::microseconds{time_us_};
+  out.value = 0;
+  out.text.clear();
+  std::uint64_t v = 0;
+  switch (out.kind) {
+  case TraceKind::GameState:
+    if (!get_varint(v)) {
+      return false;
+    }
+    out.value = std::uint32_t(v);
+    return true;
+  case TraceKind::Chat:
+    if (!get_varint(v)) {
+      return false;
+    }
+    out.value = std::uint32_t(v);
+    return get_string(out.text);
+  case TraceKind::LunaCommand:
+  case TraceKind::BindCommand:
+    return get_string(out.text);
+  case TraceKind::Data:
+    break;
+  default:
+    return true;
+  }
+  int answer_kind = -1;
+  if (!get_string(out.text) || (answer_kind = in_.get()) < 0 || answer_kind > int(TraceAnswer::Kind::Other)) {
+    return false;
+  }
+  TraceAnswer& answer = out.answer;
+  answer.kind = TraceAnswer::Kind(answer_kind);
+  answer.string.clear();
+  switch (answer.kind) {
+  case TraceAnswer::Kind::None:
+    return true;
+  case TraceAnswer::Kind::Float:
+  case TraceAnswer::Kind::Double: {
+    char raw[sizeof(double)];
+    if (!in_.read(raw, sizeof(raw))) {
+      return false;
+    }
+    std::memcpy(&answer.number, raw, sizeof(raw));
+    return true;
+  }
+  case TraceAnswer::Kind::String:
+    return get_string(answer.string);
+  default:
+    if (!get_varint(v)) {
+      return false;
+    }
+    answer.integer = unzigzag(v);
+    return true;
+  }
+}
+
+bool TraceReader::get_varint(std::uint64_t& v) {
+  v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = in_.get();
+    if (c < 0) {
+      return false;
+    }
+    v |= std::uint64_t(c & 0x7f) << shift;
+    if ((c & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool TraceReader::get_string(std::string& out) {
+  std::uint64_t len;
+  if (!get_varint(len) || len > max_string) {
+    return false;
+  }
+  out.resize(len);
+  return len == 0 || bool(in_.read(out.data(), std::streamsize(len)));
+}
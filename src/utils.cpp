@@ -7,7 +7,11 @@
 
 #include "utils.hpp"
 
+#include <algorithm>
+
 namespace zx {
+Clock clock_override = nullptr;
+
 std::vector<std::string_view> strsplit(std::string_view str, std::string_view delims) {
   std::vector<std::string_view> output;
 
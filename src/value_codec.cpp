@@ -0,0 +1,193 @@
+/*
+ * value_codec.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#include "value_codec.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+namespace {
+// deep enough for any sane data, shallow enough that decoding can't blow the C stack.
+constexpr int max_depth = 32;
+
+enum Tag : char {
+  tag_nil = 'n',
+  tag_false = 'f',
+  tag_true = 't',
+  tag_integer = 'i',
+  tag_number = 'd',
+  tag_string = 's',
+  tag_table = 'T',
+};
+
+template <typename T>
+void put(std::string& out, T value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+bool encode(lua_State* ls, int idx, std::string& out, std::string& error, int depth) {
+  switch (lua_type(ls, idx)) {
+  case LUA_TNIL:
+    out += tag_nil;
+    return true;
+  case LUA_TBOOLEAN:
+    out += lua_toboolean(ls, idx) ? tag_true : tag_false;
+    return true;
+  case LUA_TNUMBER:
+    if (lua_isinteger(ls, idx)) {
+      out += tag_integer;
+      put<std::int64_t>(out, lua_tointeger(ls, idx));
+    } else {
+      out += tag_number;
+      put<double>(out, lua_tonumber(ls, idx));
+    }
+    return true;
+  case LUA_TSTRING: {
+    size_t len;
+    auto s = lua_tolstring(ls, idx, &len);
+    out += tag_string;
+    put<std::uint32_t>(out, len);
+    out.append(s, len);
+    return true;
+  }
+  case LUA_TTABLE: {
+    if (depth >= max_depth || !lua_checkstack(ls, 3)) {
+      error = "tables are nested too deeply";
+      return false;
+    }
+    idx = lua_absindex(ls, idx);
+    out += tag_table;
+    // the pair count is patched in once it's known.
+    auto count_at = out.size();
+    put<std::uint32_t>(out, 0);
+    std::uint32_t count = 0;
+    lua_pushnil(ls);
+    while (lua_next(ls, idx) != 0) {
+      if (!encode(ls, -2, out, error, depth + 1) || !encode(ls, -1, out, error, depth + 1)) {
+        lua_pop(ls, 2);
+        return false;
+      }
+      lua_pop(ls, 1);
+      ++count;
+    }
+    std::memcpy(out.data() + count_at, &count, sizeof(count));
+    return true;
+  }
+  default:
+    error = std::string{"can't copy a "} + luaL_typename(ls, idx);
+    return false;
+  }
+}
+
+struct Reader {
+  std::string_view data;
+
+  template <typename T>
+  bool get(T& value) {
+    if (data.size() < sizeof(T)) {
+      return false;
+    }
+    std::memcpy(&value, data.data(), sizeof(T));
+    data.remove_prefix(sizeof(T));
+    return true;
+  }
+};
+
+bool decode(lua_State* ls, Reader& in, int depth) {
+  char tag;
+  if (depth >= max_depth || !in.get(tag) || !lua_checkstack(ls, 3)) {
+    return false;
+  }
+  switch (tag) {
+  case tag_nil:
+    lua_pushnil(ls);
+    return true;
+  case tag_false:
+  case tag_true:
+    lua_pushboolean(ls, tag == tag_true);
+    return true;
+  case tag_integer: {
+    std::int64_t value;
+    if (!in.get(value)) {
+      return false;
+    }
+    lua_pushinteger(ls, value);
+    return true;
+  }
+  case tag_number: {
+    double value;
+    if (!in.get(value)) {
+      return false;
+    }
+    lua_pushnumber(ls, value);
+    return true;
+  }
+  case tag_string: {
+    std::uint32_t len;
+    if (!in.get(len) || in.data.size() < len) {
+      return false;
+    }
+    lua_pushlstring(ls, in.data.data(), len);
+    in.data.remove_prefix(len);
+    return true;
+  }
+  case tag_table: {
+    std::uint32_t count;
+    if (!in.get(count)) {
+      return false;
+    }
+    lua_createtable(ls, 0, 0);
+    for (auto i = 0u; i < count; ++i) {
+      if (!decode(ls, in, depth + 1)) {
+        lua_pop(ls, 1);
+        return false;
+      }
+      if (!decode(ls, in, depth + 1)) {
+        lua_pop(ls, 2);
+        return false;
+      }
+      if (lua_isnil(ls, -2)) {
+        lua_pop(ls, 3);
+        return false;
+      }
+      lua_rawset(ls, -3);
+    }
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+} // namespace
+
+namespace zx {
+bool encode_values(lua_State* ls, int idx, int n, std::string& out, std::string& error) {
+  idx = lua_absindex(ls, idx);
+  put<std::uint32_t>(out, n);
+  for (int i = 0; i < n; ++i) {
+    if (!encode(ls, idx + i, out, error, 0)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int decode_values(lua_State* ls, std::string_view data) {
+  Reader in{data};
+  std::uint32_t n;
+  if (!in.get(n) || !lua_checkstack(ls, int(n))) {
+    return -1;
+  }
+  for (auto i = 0u; i < n; ++i) {
+    if (!decode(ls, in, 0)) {
+      lua_pop(ls, int(i));
+      return -1;
+    }
+  }
+  return int(n);
+}
+} // namespace zx
@@ -0,0 +1,271 @@
+/*
+ * worker_pool.cpp
+ * Copyright (C) 2021 rsw0x
+ *
+ * Distributed under terms of the GPLv3 license.
+ */
+
+#include "worker_pool.hpp"
+#include "value_codec.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+// how often a running job checks whether the pool is shutting down.
+constexpr int stop_check_period = 10000;
+
+const luaL_Reg sandbox_libs[] = {
+    {LUA_GNAME, luaopen_base},         {LUA_COLIBNAME, luaopen_coroutine}, {LUA_TABLIBNAME, luaopen_table},
+    {LUA_STRLIBNAME, luaopen_string},  {LUA_MATHLIBNAME, luaopen_math},    {LUA_UTF8LIBNAME, luaopen_utf8},
+    {LUA_OSLIBNAME, luaopen_os},       {nullptr, nullptr},
+};
+
+// nothing that reaches outside the state is left.
+const char* const removed_globals[] = {"dofile", "loadfile", "print"};
+const char* const removed_os[] = {"execute", "exit", "getenv", "remove", "rename", "setlocale", "tmpname"};
+
+lua_State* new_sandbox(LunaAllocator& allocator) {
+  lua_State* ls = lua_newstate(LunaAllocator::alloc, &allocator);
+  if (ls == nullptr) {
+    return nullptr;
+  }
+  for (const luaL_Reg* lib = sandbox_libs; lib->func != nullptr; ++lib) {
+    luaL_requiref(ls, lib->name, lib->func, 1);
+    lua_pop(ls, 1);
+  }
+  for (const char* name : removed_globals) {
+    lua_pushnil(ls);
+    lua_setglobal(ls, name);
+  }
+  lua_getglobal(ls, LUA_OSLIBNAME);
+  for (const char* name : removed_os) {
+    lua_pushnil(ls);
+    lua_setfield(ls, -2, name);
+  }
+  lua_pop(ls, 1);
+  // getmetatable("") would hand every job the same string metatable to change.
+  lua_pushliteral(ls, "");
+  lua_getmetatable(ls, -1);
+  lua_pushboolean(ls, false);
+  lua_setfield(ls, -2, "__metatable");
+  lua_pop(ls, 2);
+  return ls;
+}
+
+// load with the job's environment, upvalue 1, as the default instead of the worker's globals, upvalue 2 is
+// the real load.
+int job_load(lua_State* ls) {
+  if (lua_gettop(ls) < 4) {
+    lua_settop(ls, 3);
+    lua_pushvalue(ls, lua_upvalueindex(1));
+  }
+  lua_pushvalue(ls, lua_upvalueindex(2));
+  lua_insert(ls, 1);
+  lua_call(ls, lua_gettop(ls) - 1, LUA_MULTRET);
+  return lua_gettop(ls);
+}
+
+// pushes a copy of the table at idx, one level deep.
+void push_copy(lua_State* ls, int idx) {
+  idx = lua_absindex(ls, idx);
+  lua_createtable(ls, 0, 0);
+  lua_pushnil(ls);
+  while (lua_next(ls, idx) != 0) {
+    lua_pushvalue(ls, -2);
+    lua_insert(ls, -2);
+    lua_rawset(ls, -4);
+  }
+}
+
+// pushes a fresh environment for a job: the globals with copies of the library tables, its own _G, and a
+// load that defaults to it. Nothing a job changes in it reaches the worker's state or later jobs.
+void push_job_env(lua_State* ls) {
+  lua_createtable(ls, 0, 32);
+  lua_pushglobaltable(ls);
+  lua_pushnil(ls);
+  while (lua_next(ls, -2) != 0) {
+    // env, globals, key, value
+    if (lua_rawequal(ls, -1, -3)) {
+      lua_pop(ls, 1);
+      continue;
+    }
+    if (lua_istable(ls, -1)) {
+      push_copy(ls, -1);
+      lua_replace(ls, -2);
+    }
+    lua_pushvalue(ls, -2);
+    lua_insert(ls, -2);
+    lua_rawset(ls, -5);
+  }
+  lua_pushvalue(ls, -2);
+  lua_getfield(ls, -2, "load");
+  lua_pushcclosure(ls, job_load, 2);
+  lua_setfield(ls, -3, "load");
+  lua_pop(ls, 1);
+  lua_pushvalue(ls, -1);
+  lua_setfield(ls, -2, "_G");
+}
+
+// calls the job's function at 1 with the arguments encoded in the string pointed to by 2. Its setup runs
+// inside the same lua_pcall as the job, it can run into the memory limit as well.
+int run_job(lua_State* ls) {
+  auto args = static_cast<const std::string*>(lua_touserdata(ls, 2));
+  lua_settop(ls, 1);
+  push_job_env(ls);
+  if (lua_setupvalue(ls, 1, 1) == nullptr) {
+    lua_pop(ls, 1);
+  }
+  int nargs = zx::decode_values(ls, *args);
+  if (nargs < 0) {
+    return luaL_error(ls, "malformed arguments");
+  }
+  lua_call(ls, nargs, LUA_MULTRET);
+  return lua_gettop(ls);
+}
+} // namespace
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard lock{mutex_};
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (auto&& worker : workers_) {
+    worker->thread.join();
+    if (worker->ls != nullptr) {
+      lua_close(worker->ls);
+    }
+  }
+}
+
+void WorkerPool::configure(std::size_t threads, std::size_t memory_limit) {
+  if (workers_.empty()) {
+    thread_count_ = threads;
+    memory_limit_ = memory_limit;
+  }
+}
+
+void WorkerPool::start() {
+  for (auto i = 0u; i < thread_count_; ++i) {
+    auto worker = std::make_unique<Worker>();
+    worker->allocator = std::make_unique<LunaAllocator>();
+    worker->ls = new_sandbox(*worker->allocator);
+    if (worker->ls == nullptr) {
+      continue;
+    }
+    // the limit only applies to jobs, the libs are loaded already.
+    worker->allocator->set_limit(memory_limit_);
+    *static_cast<WorkerPool**>(lua_getextraspace(worker->ls)) = this;
+    lua_sethook(worker->ls, stop_hook, LUA_MASKCOUNT, stop_check_period);
+    worker->thread = std::thread{[this, w = worker.get()] { run(*w); }};
+    workers_.push_back(std::move(worker));
+  }
+}
+
+std::uint64_t WorkerPool::submit(std::uint32_t ctx_id, std::string chunk, bool binary, std::string args) {
+  auto job_id = ++last_job_id_;
+  push_job({.kind = Kind::Run, .ctx_id = ctx_id, .job_id = job_id, .chunk = std::move(chunk), .binary = binary,
+            .args = std::move(args), .cache = nullptr});
+  return job_id;
+}
+
+std::uint64_t WorkerPool::submit_compile(const BytecodeCache& cache, std::string path, std::string search_path) {
+  auto job_id = ++last_job_id_;
+  push_job({.kind = Kind::Compile, .ctx_id = 0, .job_id = job_id, .chunk = std::move(path), .binary = false,
+            .args = std::move(search_path), .cache = &cache});
+  return job_id;
+}
+
+void WorkerPool::push_job(Job job) {
+  if (workers_.empty()) {
+    start();
+  }
+  {
+    std::lock_guard lock{mutex_};
+    // compiles go ahead of the queued luna.async jobs, a module waiting to start holds up /luna run.
+    auto pos = jobs_.end();
+    if (job.kind == Kind::Compile) {
+      pos = std::find_if(jobs_.begin(), jobs_.end(), [](const Job& queued) { return queued.kind != Kind::Compile; });
+    }
+    jobs_.insert(pos, std::move(job));
+  }
+  wake_.notify_one();
+  ++pending_;
+}
+
+void WorkerPool::drain(std::vector<Result>& out) {
+  out.clear();
+  if (pending_ == 0) {
+    return;
+  }
+  {
+    std::lock_guard lock{mutex_};
+    std::swap(out, results_);
+  }
+  pending_ -= out.size();
+}
+
+void WorkerPool::stop_hook(lua_State* ls, lua_Debug*) {
+  auto pool = *static_cast<WorkerPool**>(lua_getextraspace(ls));
+  if (pool->stopping_) {
+    // raised again on every instruction from here on, a job that catches it with pcall can't keep going.
+    lua_sethook(ls, stop_hook, LUA_MASKCOUNT, 1);
+    luaL_error(ls, "luna is shutting down");
+  }
+}
+
+void WorkerPool::run(Worker& worker) {
+  for (;;) {
+    Job job;
+    {
+      std::unique_lock lock{mutex_};
+      wake_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+      if (stopping_) {
+        return;
+      }
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+    Result result = job.kind == Kind::Compile ? compile(job) : execute(worker, job);
+    std::lock_guard lock{mutex_};
+    results_.push_back(std::move(result));
+  }
+}
+
+WorkerPool::Result WorkerPool::execute(Worker& worker, Job& job) {
+  lua_State* ls = worker.ls;
+  Result result{.kind = job.kind, .ctx_id = job.ctx_id, .job_id = job.job_id, .ok = false, .payload = {}, .chunks = {}};
+  lua_settop(ls, 0);
+  if (luaL_loadbufferx(ls, job.chunk.data(), job.chunk.size(), "=async", job.binary ? "b" : "t") != LUA_OK) {
+    result.payload = lua_tostring(ls, -1);
+    lua_settop(ls, 0);
+    return result;
+  }
+  lua_pushcfunction(ls, run_job);
+  lua_insert(ls, 1);
+  lua_pushlightuserdata(ls, &job.args);
+  auto status = [&] {
+    LunaAllocator::Armed armed{*worker.allocator};
+    return lua_pcall(ls, 2, LUA_MULTRET, 0);
+  }();
+  if (status != LUA_OK) {
+    const char* msg = lua_tostring(ls, -1);
+    result.payload = msg != nullptr ? msg : "error object is not a string";
+  } else {
+    std::string error;
+    result.ok = zx::encode_values(ls, 1, lua_gettop(ls), result.payload, error);
+    if (!result.ok) {
+      result.payload = "can't return the results: " + error;
+    }
+  }
+  lua_settop(ls, 0);
+  lua_gc(ls, LUA_GCCOLLECT);
+  return result;
+}
+
+WorkerPool::Result WorkerPool::compile(Job& job) {
+  Result result{.kind = job.kind, .ctx_id = job.ctx_id, .job_id = job.job_id, .ok = true, .payload = {}, .chunks = {}};
+  job.cache->precompile(job.chunk, job.args, result.chunks);
+  return result;
+}